@@ -1,35 +1,107 @@
 #include <gflags/gflags.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <boost/asio/io_context.hpp>
 #include <boost/process.hpp>
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <format>
 #include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <span>
+#include <stop_token>
 #include <string>
 #include <tgbotxx/tgbotxx.hpp>
 #include <thread>
 #include <tuple>
+#include <variant>
 #include <vector>
 
 #include "bilibili.hpp"
+#include "budget.hpp"
 #include "config.hpp"
+#include "deadline.hpp"
 #include "douyin.hpp"
+#include "journal.hpp"
+#include "media_store.hpp"
 #include "pixiv.hpp"
 #include "quill.hpp"
+#include "scheduler.hpp"
+#include "session_pool.hpp"
+#include "single_flight.hpp"
 #include "twitter.hpp"
 #include "utils.hpp"
 #include "weibo.hpp"
+#include "work_queue.hpp"
 #include "xhs.hpp"
 
 DEFINE_string(config, "", "See config.json.example");
+DEFINE_int32(tg_api_startup_timeout_s, 60, "Give up if telegram-bot-api does not answer getMe within this time");
+DEFINE_string(journal, "", "Path of the job journal, defaults to journal.jsonl in download_dir");
+DEFINE_string(mode, "standalone",
+              "standalone: receive and process updates; ingest: receive updates and hand jobs to workers over "
+              "--queue_socket; worker: process jobs leased from the ingest process");
+DEFINE_string(queue_socket, "", "Unix socket of the work queue, defaults to ciel_parser.sock in download_dir");
+DEFINE_uint32(lease_timeout_s, 1800, "Hand a job to another worker if it is not acknowledged within this time");
+DEFINE_uint32(worker_concurrency, 16, "Number of jobs a worker process runs at the same time");
+DEFINE_uint32(workers, 16, "Number of threads running scheduled jobs, in ingest mode they only hand jobs to workers");
+DEFINE_uint32(per_chat_concurrency, 4, "Maximum number of jobs running at the same time for one chat, in ingest mode "
+              "counted until a worker acknowledges the job");
+DEFINE_uint32(sync_file_range_mib, 0, "Start writeback of downloaded files every this many MiB, 0 to disable");
+DEFINE_bool(io_uring, true, "Write downloaded files through io_uring where the kernel allows it");
+DEFINE_uint32(stats_interval_s, 60, "Interval of logging scheduler statistics, 0 to disable");
+DEFINE_uint32(job_deadline_s, 600, "Cancel a job, including its downloads and uploads, after this time");
+DEFINE_uint32(resolve_deadline_s, 60, "Give up resolving the download links of a URL after this time");
+DEFINE_uint32(download_deadline_s, 300, "Cancel the downloads of a job still running after this time");
+DEFINE_uint32(upload_deadline_s, 300, "Stop uploading the files of a job after this time");
+DEFINE_uint32(connect_timeout_s, 10, "Abort a transfer if connecting takes longer than this");
+DEFINE_int32(low_speed_bytes, 1024, "Abort a transfer slower than this many bytes per second for low_speed_time_s");
+DEFINE_uint32(low_speed_time_s, 30, "See low_speed_bytes");
+DEFINE_uint32(in_flight_budget_mib, 2048, "Maximum size of the downloads in flight at the same time, 0 to disable");
+DEFINE_uint32(download_rate_mib, 0, "Shape downloads to this many MiB per second, 0 to disable");
+DEFINE_uint32(upload_rate_mib, 0, "Shape uploads to this many MiB per second, 0 to disable");
+DEFINE_uint32(http_connections_per_host, 8, "Maximum number of requests to one host at the same time, 0 for no limit");
+DEFINE_int64(upload_cache_chat_id, 0,
+             "Chat the files of multi-file posts are uploaded to in parallel first, so the media groups can be sent "
+             "by file_id, 0 to send the files within the groups");
+DEFINE_uint32(upload_concurrency, 4, "Number of files uploaded to the cache chat at the same time");
+DEFINE_uint32(upload_attempts, 3, "Number of times the upload of one file to the cache chat is tried");
+DEFINE_int32(tg_api_max_restart_backoff_s, 60, "Upper bound of the delay before restarting a crashed telegram-bot-api");
+
+// Hosts the resolvers and downloads talk to for nearly every job, connected while telegram-bot-api starts.
+constexpr std::array<std::string_view, 5> kApiOrigins{"https://api.bilibili.com", "https://api.vxtwitter.com",
+                                                      "https://weibo.com", "https://www.pixiv.net",
+                                                      "https://www.xiaohongshu.com"};
+constexpr std::array<std::string_view, 3> kMediaOrigins{"https://ci.xiaohongshu.com", "https://i.pximg.net",
+                                                        "https://pbs.twimg.com"};
 
 class Bot final : public tgbotxx::Bot {
  public:
   explicit Bot(cielparser::Config config)
-      : tgbotxx::Bot(config.bot_token), download_dir_(std::move(config.download_dir)) {
+      : tgbotxx::Bot(config.bot_token),
+        download_dir_(std::move(config.download_dir)),
+        journal_(FLAGS_mode == "worker"   ? std::filesystem::path{}
+                 : FLAGS_journal.empty() ? download_dir_ / "journal.jsonl"
+                                         : std::filesystem::path{FLAGS_journal}),
+        file_id_index_(download_dir_ / "file_ids.jsonl"),
+        scheduler_({.workers = FLAGS_workers, .per_chat_concurrency = FLAGS_per_chat_concurrency}) {
     api()->setUrl(std::format("http://127.0.0.1:{}", config.tg_api_http_port));
+    api()->setUploadFilesTimeout(cpr::Timeout{std::chrono::seconds(FLAGS_upload_deadline_s)});
+    if (FLAGS_mode == "ingest") {
+      work_queue_ = std::make_unique<cielparser::WorkQueueServer>(
+          QueueSocketPath(), std::chrono::seconds(FLAGS_lease_timeout_s),
+          std::chrono::seconds(FLAGS_lease_timeout_s) + std::chrono::seconds(FLAGS_job_deadline_s));
+    }
+    if (FLAGS_stats_interval_s > 0) {
+      stats_reporter_ = std::jthread([this](const std::stop_token& stop) { ReportStats(stop); });
+    }
   }
 
   ~Bot() override = default;
@@ -62,39 +134,333 @@ class Bot final : public tgbotxx::Bot {
                kPlatforms);
   }
 
+  // Reschedules the jobs that were not finished before the last shutdown.
+  void Resume() const {
+    for (const auto& job : journal_.Unfinished()) {
+      LOG_INFO("Resuming {} in {} for chat {}", job.url, job.platform, job.chat_id);
+      VisitPlatform(job.platform, [&]<class Platform>() {
+        Schedule<Platform>(MakeMessage(job.chat_id, job.message_id), job.url, job.id);
+      });
+    }
+  }
+
+  // Processes jobs leased from the ingest process, never returns.
+  void RunWorker() const {
+    std::vector<std::jthread> threads;
+    for (size_t i = 0; i < FLAGS_worker_concurrency; ++i) {
+      threads.emplace_back([this] {
+        while (true) {
+          try {
+            cielparser::WorkQueueClient client(QueueSocketPath());
+            while (const auto lease = client.Lease()) {
+              const auto& job = lease->second;
+              const auto platform = job["platform"].get<std::string>();
+              const auto url = job["url"].get<std::string>();
+              const auto chat_id = job["chat_id"].get<std::int64_t>();
+              const auto message_id = job["message_id"].get<std::int32_t>();
+              LOG_INFO("Leased {} in {} for chat {}", url, platform, chat_id);
+              VisitPlatform(platform, [&]<class Platform>() {
+                ProcessUrl<Platform>(MakeMessage(chat_id, message_id), url,
+                                     journal_.Received(chat_id, message_id, platform, url));
+              });
+              client.Ack(lease->first);
+            }
+          } catch (const std::exception& e) {
+            LOG_ERROR("Work queue connection failed: {}", e.what());
+          }
+          std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+      });
+    }
+  }
+
  private:
+  std::filesystem::path QueueSocketPath() const {
+    return FLAGS_queue_socket.empty() ? download_dir_ / "ciel_parser.sock" : std::filesystem::path{FLAGS_queue_socket};
+  }
+
+  static tgbotxx::Ptr<tgbotxx::Message> MakeMessage(const std::int64_t chat_id, const std::int32_t message_id) {
+    auto message = std::make_shared<tgbotxx::Message>();
+    message->messageId = message_id;
+    message->chat = std::make_shared<tgbotxx::Chat>();
+    message->chat->id = chat_id;
+    return message;
+  }
+
+  static bool VisitPlatform(const std::string_view name, auto&& f) {
+    return std::apply(
+        [&]<class... Platform>(Platform...) {
+          return ((Platform::NAME == name && (f.template operator()<Platform>(), true)) || ...);
+        },
+        kPlatforms);
+  }
+
   template <class Platform>
   void ProcessMessage(const tgbotxx::Ptr<tgbotxx::Message>& message, const std::string_view message_content) const {
     for (const auto urls = Platform::GetUrls(message_content); auto&& url : urls) {
-      std::thread(&Bot::ProcessUrl<Platform>, this, message, url).detach();
+      Schedule<Platform>(message, url, journal_.Received(message->chat->id, message->messageId, Platform::NAME, url));
     }
   }
 
   template <class Platform>
-  void ProcessUrl(const tgbotxx::Ptr<tgbotxx::Message> message, const std::string& url) const {
-    constexpr auto platform_name = Platform::NAME;
+  void Schedule(const tgbotxx::Ptr<tgbotxx::Message>& message, const std::string& url,
+                const std::uint64_t job_id) const {
+    const std::int64_t chat_id = message->chat->id;
+    const std::int64_t user_id = message->from ? message->from->id : chat_id;
+    if (!work_queue_) {
+      scheduler_.Submit(chat_id, user_id, Platform::JOB_COST,
+                        [this, message, url, job_id] { ProcessUrl<Platform>(message, url, job_id); });
+      return;
+    }
+    // The job keeps its chat's slot until a worker acknowledges it, without holding a scheduler thread meanwhile.
+    scheduler_.SubmitDeferred(
+        chat_id, user_id, Platform::JOB_COST, [this, message, url, job_id](cielparser::FairScheduler::Release release) {
+          work_queue_->Submit({{"platform", Platform::NAME},
+                               {"url", url},
+                               {"chat_id", message->chat->id},
+                               {"message_id", message->messageId}},
+                              [this, job_id, release = std::move(release)] {
+                                journal_.Uploaded(job_id);
+                                release();
+                              });
+        });
+  }
 
-    const std::vector<std::string> download_links = Platform::GetDownloadLinks(url);
-    LOG_INFO("Processing URL {} in {}, get {} download_links", url, platform_name, download_links.size());
+  void ReportStats(const std::stop_token& stop) const {
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::unique_lock lock(mutex);
+    while (!cv.wait_for(lock, stop, std::chrono::seconds(FLAGS_stats_interval_s), [] { return false; }) &&
+           !stop.stop_requested()) {
+      const auto stats = scheduler_.GetStats();
+      LOG_INFO("Scheduler: {} queued, {} running, {} dispatched, avg wait {}ms, max wait {}ms", stats.queued,
+               stats.running, stats.total.dispatched,
+               stats.total.dispatched == 0 ? 0 : stats.total.total_wait.count() / stats.total.dispatched,
+               stats.total.max_wait.count());
+      std::string deadlines;
+      for (size_t i = 0; i < cielparser::kStageNames.size(); ++i) {
+        std::format_to(std::back_inserter(deadlines), "{}{} {}", i == 0 ? "" : ", ", cielparser::kStageNames[i],
+                       cielparser::g_deadlines_fired[i].load());
+      }
+      LOG_INFO("Deadlines fired: {}", deadlines);
+      for (const auto& [name, pool] : {std::pair{"api", &cielparser::HttpPools::api},
+                                       std::pair{"media", &cielparser::HttpPools::media}}) {
+        const auto http = pool->GetStats();
+        LOG_INFO("HTTP {}: {} requests, {} new connections, {} over HTTP/2", name, http.requests,
+                 http.new_connections, http.http2);
+      }
+      const auto in_flight = cielparser::TransferBudget::in_flight.GetUsage();
+      LOG_INFO("Transfer budget: {:.1f}/{:.1f} MiB in flight, {} waiting, {:.1f} MiB downloaded, {:.1f} MiB uploaded",
+               in_flight.in_use / 1048576.0, in_flight.capacity / 1048576.0, in_flight.waiting,
+               cielparser::TransferBudget::download.GetUsage().total / 1048576.0,
+               cielparser::TransferBudget::upload.GetUsage().total / 1048576.0);
+      const auto store = cielparser::MediaStore::GetStats();
+      const auto index = file_id_index_.GetStats();
+      LOG_INFO("Media store: {} duplicate downloads dropped ({:.1f} MiB), {} file_ids known, {} uploads skipped",
+               store.duplicate_files, store.duplicate_bytes / 1048576.0, index.entries, index.hits);
+      // Only the chats that waited longest during the interval.
+      constexpr size_t kReportedChats = 10;
+      std::vector<std::pair<std::int64_t, cielparser::FairScheduler::WaitStats>> chats(stats.chats.begin(),
+                                                                                      stats.chats.end());
+      const auto reported = chats.begin() + std::min(kReportedChats, chats.size());
+      std::ranges::partial_sort(chats, reported, std::ranges::greater{},
+                                [](const auto& chat) { return chat.second.max_wait; });
+      for (const auto& [chat_id, wait] : std::ranges::subrange(chats.begin(), reported)) {
+        LOG_INFO("Scheduler: chat {} dispatched {}, avg wait {}ms, max wait {}ms", chat_id, wait.dispatched,
+                 wait.total_wait.count() / wait.dispatched, wait.max_wait.count());
+      }
+    }
+  }
 
+  // The job runs under a JobContext: its deadline bounds every transfer and child process. The shared work of a single
+  // flight has no deadline of its own, since a later waiter may have more time left than the one that started it; it
+  // is cancelled once every waiter has left at its own deadline.
+  template <class Platform>
+  void ProcessUrl(const tgbotxx::Ptr<tgbotxx::Message> message, const std::string& url,
+                  const std::uint64_t job_id) const {
+    using cielparser::JobContext, cielparser::ScopedJobContext, cielparser::Stage;
+
+    const auto deadline = JobContext::Clock::now() + std::chrono::seconds(FLAGS_job_deadline_s);
+    ScopedJobContext job_context(JobContext{{}, deadline});
+    const auto downloaded_files = url_flights_.Do(
+        Platform::PostKey(url),
+        [this, url, job_id](std::stop_token stop) {
+          ScopedJobContext flight_context(JobContext{std::move(stop), JobContext::Clock::time_point::max()},
+                                          /*owner=*/false);
+          return ResolveAndDownload<Platform>(url, job_id);
+        },
+        {}, deadline);
+    if (!downloaded_files && JobContext::Current().Cancelled()) {
+      LOG_WARNING("Job {} for {} exceeded its deadline of {}s", job_id, url, FLAGS_job_deadline_s);
+    }
+
+    {
+      ScopedJobContext upload_context(
+          JobContext::Current().ForStage(Stage::kUpload, std::chrono::seconds(FLAGS_upload_deadline_s)));
+      SendDownloadedFiles(message, url, downloaded_files.value_or(std::vector<std::filesystem::path>{}));
+    }
+    journal_.Uploaded(job_id);
+  }
+
+  // Each link is dispatched for download as soon as the resolver yields it, so the first files of a multi-page post
+  // download while the rest is still being resolved.
+  template <class Platform>
+  std::vector<std::filesystem::path> ResolveAndDownload(const std::string& url, const std::uint64_t job_id) const {
+    using cielparser::JobContext, cielparser::ScopedJobContext, cielparser::Stage;
+    constexpr auto platform_name = Platform::NAME;
+
+    const JobContext& job_context = JobContext::Current();
+    ScopedJobContext download_scope(
+        job_context.ForStage(Stage::kDownload, std::chrono::seconds(FLAGS_download_deadline_s)));
     std::vector<std::future<std::optional<std::filesystem::path>>> futures;
-    futures.reserve(download_links.size());
-    for (const auto& link : download_links) {
-      futures.emplace_back(std::async(std::launch::async, [this, link] {
-        LOG_INFO("Try downloading {}", link);
-        return Platform::DownloadFile(link, download_dir_);
-      }));
+    const auto dispatch = [&](std::string link) {
+      futures.emplace_back(std::async(
+          std::launch::async, [this, link = std::move(link), job_id, context = download_scope.context()] {
+            ScopedJobContext scope(context, /*owner=*/false);
+            if (auto file = journal_.FindFile(link)) {
+              LOG_INFO("Reuse {} downloaded from {}", file->string(), link);
+              return file;
+            }
+            // Like the flight in ProcessUrl, the shared download only stops once every waiter has left.
+            const auto download = [this, link](std::stop_token stop) {
+              ScopedJobContext flight_context(
+                  JobContext{std::move(stop), JobContext::Clock::time_point::max(), Stage::kDownload}, /*owner=*/false);
+              LOG_INFO("Try downloading {}", link);
+              return Platform::DownloadFile(link, download_dir_);
+            };
+            auto file = link_flights_.Do(link, download, context.stop(), context.deadline()).value_or(std::nullopt);
+            if (file) {
+              journal_.Downloaded(job_id, link, *file);
+            }
+            return file;
+          }));
+    };
+
+    if (auto links = journal_.ResolvedLinks(job_id)) {
+      for (auto& link : *links) {
+        dispatch(std::move(link));
+      }
+    } else {
+      std::vector<std::string> download_links;
+      bool cancelled = false;
+      {
+        ScopedJobContext resolve_scope(
+            job_context.ForStage(Stage::kResolve, std::chrono::seconds(FLAGS_resolve_deadline_s)));
+        Platform::GetDownloadLinks(url, [&](std::string link) {
+          download_links.emplace_back(link);
+          dispatch(std::move(link));
+        });
+        cancelled = resolve_scope.context().Cancelled();
+      }
+      // Links resolved past the deadline may be incomplete, resolve them again when the job is resumed.
+      if (!cancelled) {
+        journal_.Resolved(job_id, download_links);
+      }
     }
+    LOG_INFO("Processing URL {} in {}, get {} download_links", url, platform_name, futures.size());
 
     std::vector<std::filesystem::path> downloaded_files;
-    downloaded_files.reserve(download_links.size());
+    downloaded_files.reserve(futures.size());
     for (auto& future : futures) {
       if (auto res = future.get(); res.has_value()) {
         downloaded_files.emplace_back(std::move(*res));
       }
     }
 
-    SendDownloadedFiles(message, url, downloaded_files);
+    return downloaded_files;
+  }
+
+  // Uploads files to the cache chat in parallel and returns their file_ids, so the media groups can reference them
+  // instead of carrying every file in one multipart request. Each file is retried on its own; files that still fail
+  // are left out and sent as part of their group.
+  std::map<std::filesystem::path, std::string> PreUpload(const std::vector<std::filesystem::path>& files) const {
+    std::map<std::filesystem::path, std::string> file_ids;
+    std::mutex mutex;
+    std::atomic<size_t> next{};
+    const auto& context = cielparser::JobContext::Current();
+    {
+      std::vector<std::jthread> uploaders;
+      for (size_t i = 0; i < std::min<size_t>(FLAGS_upload_concurrency, files.size()); ++i) {
+        uploaders.emplace_back([&] {
+          cielparser::ScopedJobContext scope(context, /*owner=*/false);
+          for (size_t j; (j = next++) < files.size();) {
+            if (auto file_id = UploadToCache(files[j])) {
+              std::lock_guard lock(mutex);
+              file_ids.emplace(files[j], std::move(*file_id));
+              LOG_INFO("Pre-uploaded {} ({}/{})", files[j].string(), file_ids.size(), files.size());
+            }
+          }
+        });
+      }
+    }
+    return file_ids;
+  }
+
+  std::optional<std::string> UploadToCache(const std::filesystem::path& file) const {
+    const auto& context = cielparser::JobContext::Current();
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(file, ec);
+    for (std::uint32_t attempt = 1; attempt <= FLAGS_upload_attempts && !context.Cancelled(); ++attempt) {
+      if (!cielparser::TransferBudget::upload.Consume(ec ? 0 : size)) {
+        break;
+      }
+      try {
+        if (file.extension() == ".mp4") {
+          const auto info = cielparser::GetVideoInfo(file);
+          const auto sent = api()->sendVideo(FLAGS_upload_cache_chat_id, cpr::File(file.string()), 0, info.duration,
+                                             info.width, info.height, std::monostate{}, std::monostate{}, 0, "", "", {},
+                                             false, false, true, true);
+          // Telegram turns silent clips into animations, which cannot be referenced from a video media group.
+          if (sent && sent->video) {
+            RememberFileId(file, sent);
+            return sent->video->fileId;
+          }
+          return std::nullopt;
+        }
+        const auto sent = api()->sendDocument(FLAGS_upload_cache_chat_id, cpr::File(file.string()), 0,
+                                              std::monostate{}, "", "", {}, false, true);
+        if (sent && sent->document) {
+          RememberFileId(file, sent);
+          return sent->document->fileId;
+        }
+        return std::nullopt;
+      } catch (const std::exception& e) {
+        LOG_WARNING("Pre-upload of {} failed (attempt {}/{}): {}", file.string(), attempt, FLAGS_upload_attempts,
+                    e.what());
+      }
+      if (attempt == FLAGS_upload_attempts) {
+        break;
+      }
+      std::mutex mutex;
+      std::condition_variable_any cv;
+      std::unique_lock lock(mutex);
+      cv.wait_until(lock, context.stop(),
+                    std::min(cielparser::JobContext::Clock::now() + std::chrono::seconds(attempt), context.deadline()),
+                    [] { return false; });
+    }
+    return std::nullopt;
+  }
+
+  // Files in the media store are indexed by object name, so the same contents are never uploaded twice.
+  std::optional<std::string> FindFileId(const std::filesystem::path& file) const {
+    if (!cielparser::MediaStore::IsObject(file)) {
+      return std::nullopt;
+    }
+    return file_id_index_.Find(file.filename().string());
+  }
+
+  void RememberFileId(const std::filesystem::path& file, const tgbotxx::Ptr<tgbotxx::Message>& sent) const {
+    if (!sent || !cielparser::MediaStore::IsObject(file)) {
+      return;
+    }
+    // A video Telegram turned into an animation only comes back as a document, which sendVideo would not accept.
+    if (file.extension() == ".mp4") {
+      if (sent->video) {
+        file_id_index_.Add(file.filename().string(), sent->video->fileId);
+      }
+    } else if (sent->document) {
+      file_id_index_.Add(file.filename().string(), sent->document->fileId);
+    }
   }
 
   void SendDownloadedFiles(const tgbotxx::Ptr<tgbotxx::Message>& message, const std::string& url,
@@ -109,6 +475,26 @@ class Bot final : public tgbotxx::Bot {
       return;
     }
 
+    std::map<std::filesystem::path, std::string> file_ids;
+    std::vector<std::filesystem::path> to_upload;
+    for (const auto& file : downloaded_files) {
+      if (auto file_id = FindFileId(file)) {
+        LOG_INFO("Send {} by its file_id, it was uploaded before", file.string());
+        file_ids.emplace(file, std::move(*file_id));
+      } else {
+        to_upload.emplace_back(file);
+      }
+    }
+    if (FLAGS_upload_cache_chat_id != 0 && to_upload.size() > 1) {
+      file_ids.merge(PreUpload(to_upload));
+    }
+    const auto media_of = [&](const std::filesystem::path& file) -> std::variant<cpr::File, std::string> {
+      if (const auto it = file_ids.find(file); it != file_ids.end()) {
+        return it->second;
+      }
+      return cpr::File(file.string());
+    };
+
     std::vector<std::filesystem::path> documents, videos;
     for (const auto& file : downloaded_files) {
       if (file.extension() == ".mp4") {
@@ -126,21 +512,37 @@ class Bot final : public tgbotxx::Bot {
     auto send_chunks = [&]<bool IsVideo>(const std::vector<std::filesystem::path>& files) {
       for (size_t i = 0; i < files.size(); i += chunk_size) {
         auto chunk = std::span(files).subspan(i, std::min(chunk_size, files.size() - i));
+        std::uintmax_t chunk_bytes = 0;
+        for (const auto& file : chunk) {
+          std::error_code ec;
+          const auto size = std::filesystem::file_size(file, ec);
+          chunk_bytes += ec || file_ids.contains(file) ? 0 : size;
+        }
+        if (cielparser::JobContext::Current().Cancelled() ||
+            !cielparser::TransferBudget::upload.Consume(chunk_bytes)) {
+          LOG_WARNING("Upload of {} cancelled or past its deadline, skip the remaining files", url);
+          return;
+        }
         const std::string caption = total_chunks > 1
                                         ? std::format("[source]({}) \\[{}/{}\\]", url, ++chunk_idx, total_chunks)
                                         : std::format("[source]({})", url);
 
         if (chunk.size() == 1) {
           cielparser::TryNTimes<1>([&] {
+            tgbotxx::Ptr<tgbotxx::Message> sent;
             if constexpr (IsVideo) {
               const auto info = cielparser::GetVideoInfo(chunk.front());
-              api()->sendVideo(message->chat->id, cpr::File(chunk.front().string()), 0, info.duration, info.width,
-                               info.height, std::monostate{}, std::monostate{}, 0, caption, "MarkdownV2", {}, false,
-                               false, true, false, false, nullptr, "", 0, false, "", nullptr, reply_params);
+              sent = api()->sendVideo(message->chat->id, media_of(chunk.front()), 0, info.duration, info.width,
+                                      info.height, std::monostate{}, std::monostate{}, 0, caption, "MarkdownV2", {},
+                                      false, false, true, false, false, nullptr, "", 0, false, "", nullptr,
+                                      reply_params);
             } else {
-              api()->sendDocument(message->chat->id, cpr::File(chunk.front().string()), 0, std::monostate{}, caption,
-                                  "MarkdownV2", {}, false, false, nullptr, "", 0, false, false, "", nullptr,
-                                  reply_params);
+              sent = api()->sendDocument(message->chat->id, media_of(chunk.front()), 0, std::monostate{}, caption,
+                                         "MarkdownV2", {}, false, false, nullptr, "", 0, false, false, "", nullptr,
+                                         reply_params);
+            }
+            if (!file_ids.contains(chunk.front())) {
+              RememberFileId(chunk.front(), sent);
             }
           });
           continue;
@@ -162,7 +564,7 @@ class Bot final : public tgbotxx::Bot {
           } else {
             input_media = std::make_shared<tgbotxx::InputMediaDocument>();
           }
-          input_media->media = cpr::File(file.string());
+          input_media->media = media_of(file);
           media_group.emplace_back(std::move(input_media));
         }
 
@@ -170,7 +572,13 @@ class Bot final : public tgbotxx::Bot {
         media_group.back()->parseMode = "MarkdownV2";
 
         cielparser::TryNTimes<1>([&] {
-          api()->sendMediaGroup(message->chat->id, media_group, 0, false, false, "", 0, false, "", reply_params);
+          const auto sent =
+              api()->sendMediaGroup(message->chat->id, media_group, 0, false, false, "", 0, false, "", reply_params);
+          for (size_t j = 0; j < std::min(sent.size(), chunk.size()); ++j) {
+            if (!file_ids.contains(chunk[j])) {
+              RememberFileId(chunk[j], sent[j]);
+            }
+          }
         });
       }
     };
@@ -184,8 +592,53 @@ class Bot final : public tgbotxx::Bot {
   }
 
   std::filesystem::path download_dir_;
+  mutable cielparser::Journal journal_;
+  mutable cielparser::FileIdIndex file_id_index_;
+  mutable cielparser::SingleFlight<std::string, std::vector<std::filesystem::path>> url_flights_;
+  mutable cielparser::SingleFlight<std::string, std::optional<std::filesystem::path>> link_flights_;
+  std::unique_ptr<cielparser::WorkQueueServer> work_queue_;
+  mutable cielparser::FairScheduler scheduler_;
+  std::jthread stats_reporter_;
 };
 
+void SuperviseTgApi(const auto& exe, std::vector<std::string> args) {
+  std::thread([exe, args = std::move(args)] {
+    const auto max_backoff = std::chrono::seconds(FLAGS_tg_api_max_restart_backoff_s);
+    auto backoff = std::chrono::seconds(1);
+    boost::asio::io_context ctx;
+    while (true) {
+      const auto started = std::chrono::steady_clock::now();
+      try {
+        boost::process::process tg_api(ctx, exe, args);
+        const int exit_code = tg_api.wait();
+        LOG_ERROR("telegram-bot-api exited with code {}", exit_code);
+      } catch (const std::exception& e) {
+        LOG_ERROR("Failed to run telegram-bot-api: {}", e.what());
+      }
+
+      if (std::chrono::steady_clock::now() - started > max_backoff) {
+        backoff = std::chrono::seconds(1);
+      }
+      LOG_INFO("Restarting telegram-bot-api in {} seconds", backoff.count());
+      std::this_thread::sleep_for(backoff);
+      backoff = std::min(backoff * 2, max_backoff);
+    }
+  }).detach();
+}
+
+void WaitTgApiReady(const std::string_view port, const std::string_view bot_token,
+                    const std::chrono::steady_clock::duration timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  const cpr::Url url{std::format("http://127.0.0.1:{}/bot{}/getMe", port, bot_token)};
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (cpr::Get(url, cpr::Timeout{std::chrono::seconds(1)}).status_code == 200) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  throw std::runtime_error(std::format("telegram-bot-api did not become ready on port {} in time", port));
+}
+
 int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   if (!std::filesystem::exists(FLAGS_config)) {
@@ -197,23 +650,48 @@ int main(int argc, char* argv[]) {
   }
 
   cielparser::SetupQuill(config.log_path);
+  cielparser::FileSink::sync_file_range_bytes = std::uint64_t{FLAGS_sync_file_range_mib} << 20;
+  cielparser::FileSink::use_io_uring = FLAGS_io_uring;
+  cielparser::TransferLimits::connect_timeout = std::chrono::seconds(FLAGS_connect_timeout_s);
+  cielparser::TransferLimits::low_speed_bytes = FLAGS_low_speed_bytes;
+  cielparser::TransferLimits::low_speed_time = std::chrono::seconds(FLAGS_low_speed_time_s);
+  cielparser::TransferBudget::in_flight.SetCapacity(std::uint64_t{FLAGS_in_flight_budget_mib} << 20);
+  cielparser::TransferBudget::download.SetRate(std::uint64_t{FLAGS_download_rate_mib} << 20);
+  cielparser::TransferBudget::upload.SetRate(std::uint64_t{FLAGS_upload_rate_mib} << 20);
+  cielparser::HttpPools::api.SetMaxPerOrigin(FLAGS_http_connections_per_host);
+  cielparser::HttpPools::media.SetMaxPerOrigin(FLAGS_http_connections_per_host);
   std::filesystem::create_directories(config.download_dir);
 
-  const auto exe = boost::process::environment::find_executable("telegram-bot-api");
-  if (exe.empty()) {
-    throw std::runtime_error("telegram-bot-api not found in PATH");
+  if (FLAGS_mode != "standalone" && FLAGS_mode != "ingest" && FLAGS_mode != "worker") {
+    throw std::runtime_error(std::format("Unknown mode {}", FLAGS_mode));
+  }
+
+  if (FLAGS_mode != "worker") {
+    const auto exe = boost::process::environment::find_executable("telegram-bot-api");
+    if (exe.empty()) {
+      throw std::runtime_error("telegram-bot-api not found in PATH");
+    }
+
+    SuperviseTgApi(exe, {"--local", "--api-id", config.api_id, "--api-hash", config.api_hash, "--http-port",
+                         config.tg_api_http_port});
   }
 
-  boost::asio::io_context ctx;
-  boost::process::process tg_api(
-      ctx, exe,
-      {"--local", "--api-id", config.api_id, "--api-hash", config.api_hash, "--http-port", config.tg_api_http_port});
+  std::thread([] {
+    cielparser::HttpPools::api.Warm(kApiOrigins);
+    cielparser::HttpPools::media.Warm(kMediaOrigins);
+  }).detach();
 
   LOG_INFO("Waiting for telegram-bot-api to start...");
-  std::this_thread::sleep_for(std::chrono::seconds(3));
+  WaitTgApiReady(config.tg_api_http_port, config.bot_token, std::chrono::seconds(FLAGS_tg_api_startup_timeout_s));
   LOG_INFO("telegram-bot-api started on port {}", config.tg_api_http_port);
 
   Bot bot(std::move(config));
+  if (FLAGS_mode == "worker") {
+    LOG_INFO("Starting worker...");
+    bot.RunWorker();
+    return 0;
+  }
+  bot.Resume();
   LOG_INFO("Starting bot...");
   bot.start();
 }
@@ -0,0 +1,286 @@
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "bilibili.hpp"
+#include "douyin.hpp"
+#include "media_store.hpp"
+#include "pixiv.hpp"
+#include "quill.hpp"
+#include "twitter.hpp"
+#include "utils.hpp"
+#include "weibo.hpp"
+#include "xhs.hpp"
+
+DEFINE_string(input, "-", "File with one URL (or message text) per line, - for stdin");
+DEFINE_string(output_dir, "", "Directory the media is downloaded to");
+DEFINE_string(manifest, "", "JSONL manifest, defaults to manifest.jsonl in output_dir");
+DEFINE_string(log_path, "", "Log file, defaults to ciel_parser_cli.log in output_dir");
+DEFINE_uint32(sync_file_range_mib, 0, "Start writeback of downloaded files every this many MiB, 0 to disable");
+DEFINE_bool(io_uring, true, "Write downloaded files through io_uring where the kernel allows it");
+DEFINE_uint32(in_flight_budget_mib, 2048, "Maximum size of the downloads in flight at the same time, 0 to disable");
+DEFINE_uint32(download_rate_mib, 0, "Shape downloads to this many MiB per second, 0 to disable");
+DEFINE_uint32(http_connections_per_host, 8, "Maximum number of requests to one host at the same time, 0 for no limit");
+DEFINE_uint32(resolve_concurrency, 8, "Number of posts resolved at the same time");
+DEFINE_uint32(download_concurrency, 16, "Number of files downloaded at the same time");
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kPlatforms = std::tuple<cielparser::XHS, cielparser::WeiBo, cielparser::Twitter, cielparser::Pixiv,
+                                       cielparser::Bilibili, cielparser::DouYin>{};
+
+std::int64_t MillisecondsSince(const Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+}
+
+// Closable multi-producer multi-consumer queue feeding the download stage.
+class TaskQueue {
+ public:
+  void Push(std::function<void()> task) {
+    {
+      std::lock_guard lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+
+  std::optional<std::function<void()>> Pop() {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&] { return !tasks_.empty() || closed_; });
+    if (tasks_.empty()) {
+      return std::nullopt;
+    }
+    auto task = std::move(tasks_.front());
+    tasks_.pop_front();
+    return task;
+  }
+
+  void Close() {
+    {
+      std::lock_guard lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool closed_{};
+};
+
+struct Totals {
+  std::atomic<size_t> posts{};
+  std::atomic<size_t> failed_posts{};
+  std::atomic<size_t> files{};
+  std::atomic<size_t> failed_files{};
+  std::atomic<std::uintmax_t> bytes{};
+};
+
+class Pipeline {
+ public:
+  Pipeline(std::filesystem::path output_dir, const std::filesystem::path& manifest_path)
+      : output_dir_(std::move(output_dir)), manifest_(manifest_path, std::ios::out | std::ios::app) {
+    if (!manifest_) {
+      throw std::runtime_error(std::format("Failed to open manifest {}", manifest_path.string()));
+    }
+  }
+
+  void Run(std::vector<std::function<void()>> resolve_tasks) {
+    std::atomic<size_t> next{};
+    std::vector<std::jthread> downloaders;
+    for (size_t i = 0; i < FLAGS_download_concurrency; ++i) {
+      downloaders.emplace_back([this] {
+        while (auto task = downloads_.Pop()) {
+          (*task)();
+        }
+      });
+    }
+    {
+      std::vector<std::jthread> resolvers;
+      for (size_t i = 0; i < FLAGS_resolve_concurrency; ++i) {
+        resolvers.emplace_back([&] {
+          for (size_t j; (j = next++) < resolve_tasks.size();) {
+            resolve_tasks[j]();
+          }
+        });
+      }
+    }
+    downloads_.Close();
+  }
+
+  // Downloads are queued as the resolver yields their links, before the rest of the post is resolved.
+  template <class Platform>
+  std::function<void()> MakeResolveTask(std::string url) {
+    return [this, url = std::move(url)] {
+      const auto start = Clock::now();
+      auto post = std::make_shared<Post>(Platform::NAME, url);
+      Platform::GetDownloadLinks(url, [&](std::string link) {
+        const size_t index = post->AddFile();
+        downloads_.Push([this, post, index, link = std::move(link)] { Download<Platform>(post, index, link); });
+      });
+      post->resolve_ms = MillisecondsSince(start);
+      LOG_INFO("Resolved {} in {}, get {} download_links", post->url, Platform::NAME, post->Files());
+      Release(*post);
+    };
+  }
+
+  const Totals& totals() const { return totals_; }
+
+ private:
+  struct Post {
+    Post(const std::string_view platform, std::string url) : platform(platform), url(std::move(url)) {}
+
+    size_t AddFile() {
+      std::lock_guard lock(mutex);
+      ++remaining;
+      files.emplace_back();
+      return files.size() - 1;
+    }
+
+    size_t Files() {
+      std::lock_guard lock(mutex);
+      return files.size();
+    }
+
+    std::string_view platform;
+    std::string url;
+    std::int64_t resolve_ms{};
+    std::mutex mutex;
+    std::vector<nlohmann::json> files;
+    // Downloads not finished yet, plus one held by the resolver.
+    std::atomic<size_t> remaining{1};
+  };
+
+  template <class Platform>
+  void Download(const std::shared_ptr<Post>& post, const size_t index, const std::string& link) {
+    const auto start = Clock::now();
+    const auto file = Platform::DownloadFile(link, output_dir_);
+    nlohmann::json record{{"link", link}, {"download_ms", MillisecondsSince(start)}};
+    if (file) {
+      std::error_code ec;
+      const auto size = std::filesystem::file_size(*file, ec);
+      record["path"] = *file;
+      record["size"] = ec ? 0 : size;
+      // Stored objects are named by the XXH3-128 digest computed while downloading.
+      if (cielparser::MediaStore::IsObject(*file)) {
+        record["xxh3_128"] = file->stem().string();
+      }
+      ++totals_.files;
+      totals_.bytes += ec ? 0 : size;
+    } else {
+      ++totals_.failed_files;
+    }
+
+    {
+      std::lock_guard lock(post->mutex);
+      post->files[index] = std::move(record);
+    }
+    Release(*post);
+  }
+
+  void Release(Post& post) {
+    if (--post.remaining == 0) {
+      WriteManifest(post);
+    }
+  }
+
+  void WriteManifest(const Post& post) {
+    const bool ok =
+        !post.files.empty() && std::ranges::all_of(post.files, [](const auto& file) { return file.contains("path"); });
+    ++(ok ? totals_.posts : totals_.failed_posts);
+    const nlohmann::json record{{"platform", post.platform},
+                                {"url", post.url},
+                                {"resolve_ms", post.resolve_ms},
+                                {"files", post.files}};
+    std::lock_guard lock(manifest_mutex_);
+    manifest_ << record.dump() << '\n' << std::flush;
+  }
+
+  std::filesystem::path output_dir_;
+  TaskQueue downloads_;
+  std::mutex manifest_mutex_;
+  std::ofstream manifest_;
+  Totals totals_;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_output_dir.empty()) {
+    throw std::runtime_error("--output_dir is required");
+  }
+  const std::filesystem::path output_dir = FLAGS_output_dir;
+  std::filesystem::create_directories(output_dir);
+  cielparser::SetupQuill(FLAGS_log_path.empty() ? output_dir / "ciel_parser_cli.log"
+                                                : std::filesystem::path{FLAGS_log_path});
+  cielparser::FileSink::sync_file_range_bytes = std::uint64_t{FLAGS_sync_file_range_mib} << 20;
+  cielparser::FileSink::use_io_uring = FLAGS_io_uring;
+  cielparser::TransferBudget::in_flight.SetCapacity(std::uint64_t{FLAGS_in_flight_budget_mib} << 20);
+  cielparser::TransferBudget::download.SetRate(std::uint64_t{FLAGS_download_rate_mib} << 20);
+  cielparser::HttpPools::api.SetMaxPerOrigin(FLAGS_http_connections_per_host);
+  cielparser::HttpPools::media.SetMaxPerOrigin(FLAGS_http_connections_per_host);
+
+  std::ifstream input_file;
+  if (FLAGS_input != "-") {
+    input_file.open(FLAGS_input);
+    if (!input_file) {
+      throw std::runtime_error(std::format("Input file {} not found", FLAGS_input));
+    }
+  }
+  std::istream& input = FLAGS_input == "-" ? std::cin : input_file;
+
+  Pipeline pipeline(output_dir, FLAGS_manifest.empty() ? output_dir / "manifest.jsonl"
+                                                       : std::filesystem::path{FLAGS_manifest});
+
+  std::vector<std::function<void()>> resolve_tasks;
+  for (std::string line; std::getline(input, line);) {
+    std::apply(
+        [&]<class... Platform>(Platform...) {
+          (
+              [&] {
+                for (auto&& url : Platform::GetUrls(line)) {
+                  resolve_tasks.emplace_back(pipeline.MakeResolveTask<Platform>(std::move(url)));
+                }
+              }(),
+              ...);
+        },
+        kPlatforms);
+  }
+  LOG_INFO("Read {} URLs from {}", resolve_tasks.size(), FLAGS_input);
+
+  const auto start = Clock::now();
+  pipeline.Run(std::move(resolve_tasks));
+  const double seconds = std::max<double>(MillisecondsSince(start), 1) / 1000;
+
+  const auto& totals = pipeline.totals();
+  LOG_INFO("Finished in {:.1f}s: {} posts ({} failed), {} files ({} failed), {:.1f} MiB", seconds,
+           totals.posts.load(), totals.failed_posts.load(), totals.files.load(), totals.failed_files.load(),
+           totals.bytes.load() / 1048576.0);
+  LOG_INFO("Throughput: {:.2f} posts/s, {:.2f} files/s, {:.2f} MiB/s", totals.posts.load() / seconds,
+           totals.files.load() / seconds, totals.bytes.load() / 1048576.0 / seconds);
+  const auto media = cielparser::HttpPools::media.GetStats();
+  LOG_INFO("Media downloads: {} requests, {} new connections, {} over HTTP/2", media.requests, media.new_connections,
+           media.http2);
+}
@@ -11,7 +11,9 @@
 #include <string_view>
 #include <vector>
 
+#include "matchers.hpp"
 #include "quill.hpp"
+#include "session_pool.hpp"
 #include "utils.hpp"
 
 namespace cielparser {
@@ -19,69 +21,71 @@ namespace cielparser {
 class Bilibili {
   inline static const std::regex url_pattern{
       R"((?:https?://)?(?:(?:(?:www\.|m\.|t\.)?bilibili\.com/(?:video|opus)/)|(?:b23\.tv|bili2233\.cn)/)[^ \s\u3000]+)"};
+  static constexpr HttpProfile<1> page_profile{
+      .headers = {{{"User-Agent",
+                    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+                    "Chrome/120.0.0.0 Safari/537.36"}}}};
+  static constexpr HttpProfile<2> http_profile{
+      .headers = {{{"Referer", "https://www.bilibili.com"}, {"User-Agent", "Mozilla/5.0"}}}};
 
  public:
   static constexpr std::string_view NAME = "Bilibili";
+  static constexpr size_t JOB_COST = 8;
 
   static std::vector<std::string> GetUrls(const std::string_view message) {
     return GetMatchedUrlsFromPattern(message, url_pattern);
   }
 
-  static std::vector<std::string> GetDownloadLinks(const std::string_view url) {
-    std::vector<std::string> res;
+  // Short links carry no BV ID until they are resolved, so they only coalesce with the same short link.
+  static std::string PostKey(const std::string_view url) {
+    const std::string_view bvid = FindBvid(url);
+    return bvid.empty() ? CanonicalUrlKey(NAME, url) : std::format("{}:{}", NAME, bvid);
+  }
 
+  static void GetDownloadLinks(const std::string_view url, const LinkSink& emit) {
     try {
-      cpr::Session session;
-      session.SetUrl(cpr::Url{url});
-      session.SetHeader(cpr::Header{{"User-Agent",
-                                     "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
-                                     "Chrome/120.0.0.0 Safari/537.36"}});
-      const auto resp = session.Get();
-      const std::string final_url = resp.url.str();
-      const std::regex bv_re(R"(BV[a-zA-Z0-9]{10})");
-      std::smatch match;
-      if (!std::regex_search(final_url, match, bv_re)) {
-        return res;
+      // Only the URL the short link redirects to is needed, whatever the page itself answers.
+      auto lease = HttpPools::api.Acquire(url);
+      if (!lease) {
+        LOG_WARNING("Skip resolving {}, the job is cancelled or past its deadline", url);
+        return;
+      }
+      PrepareRequest(lease->session(), url, StaticHeaders<page_profile>());
+      const auto resp = lease->Get();
+      const std::string_view bvid = FindBvid(resp.url.str());
+      if (bvid.empty()) {
+        return;
       }
 
-      const std::string bvid = match.str();
-      const auto view_resp = HttpGet(std::format("https://api.bilibili.com/x/web-interface/view?bvid={}", bvid));
+      const auto view_resp = HttpGet(FormatUrl("https://api.bilibili.com/x/web-interface/view?bvid={}", bvid));
       if (!view_resp) {
-        return res;
+        return;
       }
 
       for (const auto view_json = nlohmann::json::parse(view_resp->text);
            const auto& page : view_json["data"]["pages"]) {
         const auto cid = page["cid"].get<uint64_t>();
         const auto play_resp =
-            HttpGet(std::format("https://api.bilibili.com/x/player/playurl?bvid={}&cid={}&qn=120", bvid, cid),
-                    {{"Referer", "https://www.bilibili.com"}, {"User-Agent", "Mozilla/5.0"}});
+            HttpGet(FormatUrl("https://api.bilibili.com/x/player/playurl?bvid={}&cid={}&qn=120", bvid, cid),
+                    StaticHeaders<http_profile>());
         if (!play_resp) {
           continue;
         }
 
         for (const auto play_json = nlohmann::json::parse(play_resp->text);
              const auto& item : play_json["data"]["durl"]) {
-          res.emplace_back(item["url"].get<std::string>());
+          emit(item["url"].get<std::string>());
         }
       }
     } catch (const std::exception& e) {
       LOG_ERROR("Failed to get download links for {}: {}", url, e.what());
     }
-
-    return res;
   }
 
   static std::optional<std::filesystem::path> DownloadFile(const std::string_view download_link,
                                                            const std::filesystem::path& download_dir) {
-    const auto r = HttpGet(download_link, {{"User-Agent", "Mozilla/5.0"}, {"Referer", "https://www.bilibili.com"}});
-    if (!r) {
-      return std::nullopt;
-    }
-
-    const auto ext = download_link.substr(download_link.rfind('.'), download_link.find('?') - download_link.rfind('.'));
-
-    return SaveContents(download_dir, ext, download_link, r->text);
+    return HttpDownload(download_link, download_dir, http_profile.ExtensionForUrl(download_link),
+                        StaticHeaders<http_profile>());
   }
 };
 
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "deadline.hpp"
+
+namespace cielparser {
+
+// Bytes of downloads in flight across the process. A download reserves its Content-Length before the body is written
+// and waits while the budget is exhausted. A reservation larger than the whole budget is admitted once it is alone, so
+// one oversized file cannot block forever. Only that first reservation waits: a transfer already holding bytes never
+// waits for more, since two transfers growing into a full budget would each wait for the other forever. A body longer
+// than reserved overdraws the budget instead, which holds back new transfers until it finishes. A capacity of 0
+// disables the budget.
+class ByteBudget {
+ public:
+  void SetCapacity(const std::uint64_t capacity) {
+    {
+      std::lock_guard lock(mutex_);
+      capacity_ = capacity;
+    }
+    cv_.notify_all();
+  }
+
+  // Grows a reservation currently holding held bytes by bytes, waiting only if held is 0. Returns false if the job is
+  // cancelled or past its deadline before the bytes became available.
+  bool Acquire(const std::uint64_t bytes, const std::uint64_t held, const JobContext& context) {
+    std::unique_lock lock(mutex_);
+    if (held > 0) {
+      in_use_ += bytes;
+      return true;
+    }
+    ++waiting_;
+    const bool acquired = cv_.wait_until(lock, context.stop(), context.deadline(), [&] { return Fits(bytes); });
+    --waiting_;
+    if (acquired) {
+      in_use_ += bytes;
+    }
+    return acquired;
+  }
+
+  // Like Acquire, but returns false instead of waiting. A caller that was refused counts as waiting until its next call
+  // succeeds or it calls StopWaiting.
+  bool TryAcquire(const std::uint64_t bytes, const std::uint64_t held, const bool was_waiting) {
+    std::lock_guard lock(mutex_);
+    const bool acquired = held > 0 || Fits(bytes);
+    if (acquired) {
+      in_use_ += bytes;
+    }
+    if (acquired && was_waiting) {
+      --waiting_;
+    } else if (!acquired && !was_waiting) {
+      ++waiting_;
+    }
+    return acquired;
+  }
+
+  void StopWaiting() {
+    std::lock_guard lock(mutex_);
+    --waiting_;
+  }
+
+  void Release(const std::uint64_t bytes) {
+    {
+      std::lock_guard lock(mutex_);
+      in_use_ -= bytes;
+    }
+    cv_.notify_all();
+  }
+
+  struct Usage {
+    std::uint64_t capacity;
+    std::uint64_t in_use;
+    size_t waiting;
+  };
+
+  Usage GetUsage() const {
+    std::lock_guard lock(mutex_);
+    return {capacity_, in_use_, waiting_};
+  }
+
+ private:
+  // Called with mutex_ held.
+  bool Fits(const std::uint64_t bytes) const { return capacity_ == 0 || in_use_ == 0 || in_use_ + bytes <= capacity_; }
+
+  mutable std::mutex mutex_;
+  std::condition_variable_any cv_;
+  std::uint64_t capacity_{};
+  std::uint64_t in_use_{};
+  size_t waiting_{};
+};
+
+// Bytes held from a ByteBudget by one transfer, released when it goes out of scope.
+class BudgetReservation {
+ public:
+  explicit BudgetReservation(ByteBudget& budget) : budget_(budget) {}
+
+  BudgetReservation(const BudgetReservation&) = delete;
+  BudgetReservation& operator=(const BudgetReservation&) = delete;
+
+  ~BudgetReservation() {
+    if (held_ > 0) {
+      budget_.Release(held_);
+    }
+    if (waiting_) {
+      budget_.StopWaiting();
+    }
+  }
+
+  // Makes sure at least bytes are held.
+  bool Reserve(const std::uint64_t bytes, const JobContext& context) {
+    if (bytes <= held_) {
+      return true;
+    }
+    if (!budget_.Acquire(bytes - held_, held_, context)) {
+      return false;
+    }
+    held_ = bytes;
+    return true;
+  }
+
+  // Like Reserve, but returns false instead of waiting.
+  bool TryReserve(const std::uint64_t bytes) {
+    if (bytes <= held_) {
+      return true;
+    }
+    const bool acquired = budget_.TryAcquire(bytes - held_, held_, waiting_);
+    waiting_ = !acquired;
+    if (acquired) {
+      held_ = bytes;
+    }
+    return acquired;
+  }
+
+  std::uint64_t held() const { return held_; }
+
+ private:
+  ByteBudget& budget_;
+  std::uint64_t held_{};
+  bool waiting_{};
+};
+
+// Token bucket shaping a byte stream to bytes_per_second, allowing bursts of one second worth of bytes. Consume charges
+// the bytes right away and blocks the caller for as long as the bucket is in debt. A rate of 0 disables shaping.
+class RateLimiter {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr auto kBurst = std::chrono::seconds(1);
+
+  void SetRate(const std::uint64_t bytes_per_second) {
+    std::lock_guard lock(mutex_);
+    rate_ = bytes_per_second;
+  }
+
+  // Returns false if the job is cancelled or past its deadline while waiting.
+  bool Consume(const std::uint64_t bytes, const JobContext& context = JobContext::Current()) {
+    const auto ready = Charge(bytes);
+    if (ready <= Clock::now()) {
+      return true;
+    }
+
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::unique_lock lock(mutex);
+    cv.wait_until(lock, context.stop(), std::min(ready, context.deadline()), [] { return false; });
+    return !context.Cancelled();
+  }
+
+  // Charges the bytes like Consume, but returns when the caller may go on instead of waiting for it.
+  Clock::time_point Charge(const std::uint64_t bytes) {
+    std::lock_guard lock(mutex_);
+    total_ += bytes;
+    if (rate_ == 0) {
+      return {};
+    }
+    const auto now = Clock::now();
+    const auto cost = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(bytes) / static_cast<double>(rate_)));
+    full_at_ = std::max(full_at_, now) + cost;
+    return full_at_ - kBurst;
+  }
+
+  struct Usage {
+    std::uint64_t rate;
+    std::uint64_t total;
+  };
+
+  Usage GetUsage() const {
+    std::lock_guard lock(mutex_);
+    return {rate_, total_};
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::uint64_t rate_{};
+  std::uint64_t total_{};
+  // When the bucket would be full again if nothing else were consumed.
+  Clock::time_point full_at_{};
+};
+
+// Limits shared by every transfer of the process.
+struct TransferBudget {
+  // Reserved up front for a body without Content-Length, such as a chunked response.
+  static constexpr std::uint64_t kUnknownLengthReservation = std::uint64_t{4} << 20;
+  // How soon a download paused on a full in_flight budget tries again.
+  static constexpr std::chrono::milliseconds kRetryInterval{50};
+
+  inline static ByteBudget in_flight;
+  inline static RateLimiter download;
+  inline static RateLimiter upload;
+};
+
+}  // namespace cielparser
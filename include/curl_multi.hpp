@@ -0,0 +1,137 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <semaphore>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cielparser {
+
+// One libcurl multi handle driven by a dedicated thread. Every pooled request runs on it, so requests to one host find
+// its connections in the multi handle's cache and multiplex over a single HTTP/2 connection, and that cache is only
+// ever touched by the driver thread. Callers block in Perform until their transfer is done, while the callbacks of
+// their handle run on the driver thread and must not block: a write callback that has to wait calls ResumeAt and
+// returns CURL_WRITEFUNC_PAUSE, and gets the same data again once the driver unpauses it.
+class CurlMulti {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static CurlMulti& Shared() {
+    static CurlMulti multi;
+    return multi;
+  }
+
+  CurlMulti() : multi_(curl_multi_init()) {
+    curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    driver_ = std::jthread([this](const std::stop_token& stop) { Drive(stop); });
+  }
+
+  CurlMulti(const CurlMulti&) = delete;
+  CurlMulti& operator=(const CurlMulti&) = delete;
+
+  ~CurlMulti() {
+    driver_.request_stop();
+    curl_multi_wakeup(multi_);
+    driver_.join();
+    curl_multi_cleanup(multi_);
+  }
+
+  // Runs the transfer configured on handle and returns its result.
+  CURLcode Perform(CURL* handle) {
+    Transfer transfer{handle};
+    {
+      std::lock_guard lock(mutex_);
+      pending_.push_back(&transfer);
+    }
+    curl_multi_wakeup(multi_);
+    transfer.done.acquire();
+    return transfer.result;
+  }
+
+  // Unpauses handle once when has passed. Only to be called from a callback of a transfer running on this multi.
+  void ResumeAt(CURL* handle, const Clock::time_point when) { paused_.emplace_back(handle, when); }
+
+ private:
+  struct Transfer {
+    CURL* handle;
+    CURLcode result{CURLE_OK};
+    std::binary_semaphore done{0};
+  };
+
+  void Drive(const std::stop_token& stop) {
+    std::unordered_map<CURL*, Transfer*> running;
+    const auto finish = [&](CURL* handle, const CURLcode result) {
+      curl_multi_remove_handle(multi_, handle);
+      std::erase_if(paused_, [&](const auto& paused) { return paused.first == handle; });
+      const auto transfer = running.extract(handle).mapped();
+      transfer->result = result;
+      transfer->done.release();
+    };
+
+    while (!stop.stop_requested()) {
+      {
+        std::lock_guard lock(mutex_);
+        for (Transfer* transfer : pending_) {
+          if (curl_multi_add_handle(multi_, transfer->handle) != CURLM_OK) {
+            transfer->result = CURLE_FAILED_INIT;
+            transfer->done.release();
+            continue;
+          }
+          running.emplace(transfer->handle, transfer);
+        }
+        pending_.clear();
+      }
+
+      // Unpausing may call the write callback right away, which may pause the transfer again.
+      const auto now = Clock::now();
+      const auto due = std::ranges::partition(paused_, [&](const auto& paused) { return paused.second > now; });
+      std::vector<std::pair<CURL*, Clock::time_point>> resumed(due.begin(), due.end());
+      paused_.erase(due.begin(), due.end());
+      for (const auto& [handle, when] : resumed) {
+        curl_easy_pause(handle, CURLPAUSE_CONT);
+      }
+
+      int still_running = 0;
+      curl_multi_perform(multi_, &still_running);
+      int queued = 0;
+      while (const CURLMsg* message = curl_multi_info_read(multi_, &queued)) {
+        if (message->msg == CURLMSG_DONE) {
+          finish(message->easy_handle, message->data.result);
+        }
+      }
+
+      // curl_multi_poll also wakes up for libcurl's own timeouts.
+      auto timeout = std::chrono::milliseconds(1000);
+      for (const auto& [handle, when] : paused_) {
+        timeout = std::clamp(std::chrono::ceil<std::chrono::milliseconds>(when - Clock::now()),
+                             std::chrono::milliseconds(0), timeout);
+      }
+      curl_multi_poll(multi_, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+    }
+
+    std::lock_guard lock(mutex_);
+    for (Transfer* transfer : std::exchange(pending_, {})) {
+      transfer->result = CURLE_ABORTED_BY_CALLBACK;
+      transfer->done.release();
+    }
+    while (!running.empty()) {
+      finish(running.begin()->first, CURLE_ABORTED_BY_CALLBACK);
+    }
+  }
+
+  CURLM* multi_;
+  std::mutex mutex_;
+  std::vector<Transfer*> pending_;
+  // Touched by the driver thread only.
+  std::vector<std::pair<CURL*, Clock::time_point>> paused_;
+  std::jthread driver_;
+};
+
+}  // namespace cielparser
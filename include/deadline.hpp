@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stop_token>
+#include <string_view>
+
+namespace cielparser {
+
+enum class Stage { kJob, kResolve, kDownload, kUpload };
+
+inline constexpr std::array<std::string_view, 4> kStageNames{"job", "resolve", "download", "upload"};
+
+// How many times the deadline of each stage has fired.
+inline std::array<std::atomic<std::uint64_t>, kStageNames.size()> g_deadlines_fired{};
+
+// Limits applied to every HTTP transfer on top of the deadline of the job: give up if connecting takes longer than
+// connect_timeout, or if less than low_speed_bytes per second arrive for low_speed_time.
+struct TransferLimits {
+  inline static std::chrono::seconds connect_timeout{10};
+  inline static std::int32_t low_speed_bytes{1024};
+  inline static std::chrono::seconds low_speed_time{30};
+};
+
+// Deadline and cancellation of the job running on the current thread. HttpGet and RunProcess consult it, so a job
+// that is cancelled or overdue aborts its transfers and child processes instead of hanging its thread forever.
+class JobContext {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  JobContext() = default;
+
+  JobContext(std::stop_token stop, const Clock::time_point deadline, const Stage stage = Stage::kJob)
+      : stop_(std::move(stop)), deadline_(deadline), stage_(stage) {}
+
+  static const JobContext& Current() {
+    static const JobContext unbounded;
+    return current_ ? *current_ : unbounded;
+  }
+
+  bool Cancelled() const { return stop_.stop_requested() || Clock::now() >= deadline_; }
+
+  // Time left, capped to a day so it can be handed to libcurl without overflowing.
+  std::chrono::milliseconds Remaining() const {
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - Clock::now());
+    return std::clamp<std::chrono::milliseconds>(remaining, std::chrono::milliseconds(0), std::chrono::hours(24));
+  }
+
+  const std::stop_token& stop() const { return stop_; }
+
+  Clock::time_point deadline() const { return deadline_; }
+
+  // The same job narrowed to a stage which has to finish within budget.
+  JobContext ForStage(const Stage stage, const Clock::duration budget) const {
+    const auto now = Clock::now();
+    const auto stage_deadline = budget >= deadline_ - now ? deadline_ : now + budget;
+    return {stop_, stage_deadline, stage_deadline == deadline_ ? stage_ : stage};
+  }
+
+ private:
+  friend class ScopedJobContext;
+
+  inline static thread_local const JobContext* current_{};
+
+  std::stop_token stop_;
+  Clock::time_point deadline_{Clock::time_point::max()};
+  Stage stage_{Stage::kJob};
+};
+
+// Installs a JobContext for the current thread. The owner of a context, as opposed to helper threads it is handed
+// to, counts its deadline as fired if it has passed when the scope ends and is tighter than the enclosing one.
+class ScopedJobContext {
+ public:
+  explicit ScopedJobContext(JobContext context, const bool owner = true)
+      : context_(std::move(context)), previous_(JobContext::current_), owner_(owner) {
+    JobContext::current_ = &context_;
+  }
+
+  ScopedJobContext(const ScopedJobContext&) = delete;
+  ScopedJobContext& operator=(const ScopedJobContext&) = delete;
+
+  ~ScopedJobContext() {
+    JobContext::current_ = previous_;
+    if (owner_ && context_.deadline() <= JobContext::Clock::now() &&
+        (!previous_ || previous_->deadline() > context_.deadline())) {
+      ++g_deadlines_fired[static_cast<size_t>(context_.stage_)];
+    }
+  }
+
+  const JobContext& context() const { return context_; }
+
+ private:
+  JobContext context_;
+  const JobContext* previous_;
+  bool owner_;
+};
+
+}  // namespace cielparser
@@ -1,9 +1,7 @@
 #pragma once
 
-#include <array>
 #include <filesystem>
 #include <format>
-#include <memory>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <regex>
@@ -18,41 +16,33 @@ namespace cielparser {
 
 class DouYin {
   inline static const std::regex url_pattern{R"(https?://v\.douyin\.com/[a-zA-Z0-9_-]+/?)"};
+  static constexpr HttpProfile<1, 2> http_profile{.headers = {{{"Referer", "https://www.douyin.com/"}}},
+                                                  .mime_types = {{{"video", ".mp4"}, {"image", ".jpeg"}}}};
 
  public:
   static constexpr std::string_view NAME = "DouYin";
+  static constexpr size_t JOB_COST = 8;
 
   static std::vector<std::string> GetUrls(const std::string_view message) {
     return GetMatchedUrlsFromPattern(message, url_pattern);
   }
 
-  static std::vector<std::string> GetDownloadLinks(const std::string_view url) {
-    std::vector<std::string> res;
+  // Share links carry no post ID until they are resolved.
+  static std::string PostKey(const std::string_view url) { return CanonicalUrlKey(NAME, url); }
 
+  static void GetDownloadLinks(const std::string_view url, const LinkSink& emit) {
     try {
       const std::string python_script =
           std::filesystem::path(__FILE__).parent_path().parent_path() / "scripts" / "douyin_parser.py";
-      const std::string cmd = std::format(R"(python3 "{}" "{}" 2>/dev/null)", python_script, url);
-
-      const std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-      if (!pipe) {
-        LOG_ERROR("Failed to run douyin parser script");
-        return res;
+      const auto output = RunProcess({"python3", python_script, std::string{url}});
+      if (!output || output->empty()) {
+        return;
       }
 
-      std::array<char, 128> buffer{};
-      std::string output;
-      while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        output += buffer.data();
-      }
-      if (output.empty()) {
-        return res;
-      }
-
-      if (const auto json = nlohmann::json::parse(output); json.is_array()) {
+      if (const auto json = nlohmann::json::parse(*output); json.is_array()) {
         for (const auto& item : json) {
           if (item.is_string()) {
-            res.emplace_back(item.get<std::string>());
+            emit(item.get<std::string>());
           }
         }
       } else if (json.contains("error")) {
@@ -63,25 +53,14 @@ class DouYin {
     } catch (const std::exception& e) {
       LOG_ERROR("Failed to get download links for {}: {}", url, e.what());
     }
-
-    return res;
   }
 
   static std::optional<std::filesystem::path> DownloadFile(const std::string_view download_link,
                                                            const std::filesystem::path& download_dir) {
-    auto r = HttpGet(download_link, {{"Referer", "https://www.douyin.com/"}});
-    if (!r) {
-      return std::nullopt;
-    }
-
-    std::string ext = ".bin";
-    if (r->header["Content-Type"].contains("video")) {
-      ext = ".mp4";
-    } else if (r->header["Content-Type"].contains("image")) {
-      ext = ".jpeg";
-    }
-
-    return SaveContents(download_dir, ext, download_link, r->text);
+    return HttpDownload(
+        download_link, download_dir,
+        [](const std::string_view content_type) { return http_profile.ExtensionForMime(content_type); },
+        StaticHeaders<http_profile>());
   }
 };
 
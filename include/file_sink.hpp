@@ -0,0 +1,276 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include "io_uring.hpp"
+#include "quill.hpp"
+
+namespace cielparser {
+
+// A file being downloaded into. The name is claimed atomically with O_EXCL and a per-process counter, the expected
+// size is preallocated, and chunks are written with pwrite. Once sync_file_range_bytes is non-zero, writeback is
+// started every that many bytes and the previous window is waited on, which bounds the dirty page cache a burst of
+// big videos can build up. The contents are hashed with XXH3-128 as they are written. A sink that is not committed
+// removes its file.
+//
+// With use_io_uring set, chunks are copied into kBuffers buffers instead, and a file outgrowing the first one gets an
+// IoUring which writes each full buffer while the next fills. Where io_uring cannot be set up or rejects writes, it is
+// turned off for the whole process and the sink writes with pwrite.
+class FileSink {
+ public:
+  inline static std::atomic<std::uint64_t> sync_file_range_bytes{0};
+  inline static std::atomic<bool> use_io_uring{true};
+
+  static constexpr size_t kBuffers = 4;
+  static constexpr size_t kBufferSize = 256 << 10;
+
+  static std::optional<FileSink> Create(const std::filesystem::path& dir, const std::string_view ext,
+                                        const std::uint64_t expected_size = 0) {
+    static std::atomic<std::uint64_t> counter{0};
+
+    const auto tt = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::tm lt{};
+    localtime_r(&tt, &lt);
+    char time_buf[16];
+    std::strftime(time_buf, sizeof(time_buf), "%Y%m%d_%H%M%S", &lt);
+
+    for (int attempt = 0; attempt < 16; ++attempt) {
+      auto path = dir / std::format("{}_{}_{:06}{}", time_buf, ::getpid(), counter++, ext);
+      const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (fd >= 0) {
+        if (expected_size > 0 && ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(expected_size)) != 0) {
+          LOG_WARNING("fallocate {} bytes for {} failed, errno = {}", expected_size, path.string(), errno);
+        }
+        return FileSink(fd, std::move(path));
+      }
+      if (errno != EEXIST) {
+        LOG_ERROR("Failed to create {}, errno = {}", path.string(), errno);
+        return std::nullopt;
+      }
+    }
+    LOG_ERROR("Failed to find a free file name in {}", dir.string());
+    return std::nullopt;
+  }
+
+  FileSink(FileSink&& other) noexcept
+      : fd_(std::exchange(other.fd_, -1)),
+        path_(std::move(other.path_)),
+        written_(other.written_),
+        synced_(other.synced_),
+        hash_(other.hash_),
+        buffered_(other.buffered_),
+        buffers_(std::move(other.buffers_)),
+        current_(other.current_),
+        in_flight_(other.in_flight_),
+        ring_(std::move(other.ring_)) {}
+
+  FileSink& operator=(FileSink&&) = delete;
+
+  ~FileSink() { Abort(); }
+
+  bool Write(std::string_view data) {
+    XXH3_128bits_update(&hash_, data.data(), data.size());
+    if (!buffered_) {
+      if (!WriteAt(data, written_)) {
+        return false;
+      }
+      written_ += data.size();
+      data = {};
+    }
+    while (!data.empty()) {
+      auto& buffer = buffers_[current_];
+      if (!buffer.data) {
+        buffer.data = std::make_unique_for_overwrite<char[]>(kBufferSize);
+      }
+      const size_t n = std::min(kBufferSize - buffer.size, data.size());
+      std::memcpy(buffer.data.get() + buffer.size, data.data(), n);
+      buffer.size += n;
+      written_ += n;
+      data.remove_prefix(n);
+      if (buffer.size == kBufferSize && !Submit()) {
+        return false;
+      }
+    }
+
+    if (const auto window = sync_file_range_bytes.load(std::memory_order_relaxed);
+        window > 0 && written_ - synced_ >= window) {
+      if (buffered_ && (!Submit() || !Drain())) {
+        return false;
+      }
+      ::sync_file_range(fd_, static_cast<off_t>(synced_), static_cast<off_t>(written_ - synced_),
+                        SYNC_FILE_RANGE_WRITE);
+      if (synced_ > 0) {
+        const auto previous = synced_ >= window ? synced_ - window : 0;
+        ::sync_file_range(fd_, static_cast<off_t>(previous), static_cast<off_t>(synced_ - previous),
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      }
+      synced_ = written_;
+    }
+    return true;
+  }
+
+  std::optional<std::filesystem::path> Commit() {
+    if (fd_ < 0) {
+      return std::nullopt;
+    }
+    if (buffered_ && (!Submit() || !Drain())) {
+      Abort();
+      return std::nullopt;
+    }
+    if (::close(std::exchange(fd_, -1)) != 0) {
+      LOG_ERROR("Failed to close {}, errno = {}", path_.string(), errno);
+      std::filesystem::remove(path_);
+      return std::nullopt;
+    }
+    return std::move(path_);
+  }
+
+  void Abort() {
+    if (fd_ < 0) {
+      return;
+    }
+    // The kernel may still be reading from the buffers.
+    Drain();
+    ::close(std::exchange(fd_, -1));
+    std::error_code ec;
+    std::filesystem::remove(path_, ec);
+  }
+
+  const std::filesystem::path& path() const { return path_; }
+
+  std::uint64_t written() const { return written_; }
+
+  // The digest of everything written so far.
+  XXH128_hash_t digest() const { return XXH3_128bits_digest(&hash_); }
+
+ private:
+  struct Buffer {
+    std::unique_ptr<char[]> data;
+    size_t size{};
+    std::uint64_t offset{};
+    bool in_flight{};
+  };
+
+  FileSink(const int fd, std::filesystem::path path)
+      : fd_(fd), path_(std::move(path)), buffered_(use_io_uring.load(std::memory_order_relaxed)) {
+    XXH3_128bits_reset(&hash_);
+  }
+
+  bool WriteAt(std::string_view data, std::uint64_t offset) const {
+    while (!data.empty()) {
+      const ssize_t n = ::pwrite(fd_, data.data(), data.size(), static_cast<off_t>(offset));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_ERROR("Failed to write {}, errno = {}", path_.string(), errno);
+        return false;
+      }
+      data.remove_prefix(n);
+      offset += n;
+    }
+    return true;
+  }
+
+  // Writes the current buffer, through the ring while a file keeps growing, and moves on to the next free buffer.
+  bool Submit() {
+    auto& buffer = buffers_[current_];
+    if (buffer.size == 0) {
+      return true;
+    }
+    buffer.offset = written_ - buffer.size;
+    if (!ring_ && buffer.size == kBufferSize && use_io_uring.load(std::memory_order_relaxed)) {
+      ring_ = IoUring::Create(kBuffers);
+      if (!ring_ && use_io_uring.exchange(false)) {
+        LOG_WARNING("io_uring is not available, errno = {}, write files with pwrite", errno);
+      }
+    }
+    if (ring_ && use_io_uring.load(std::memory_order_relaxed) &&
+        ring_->Write(fd_, buffer.data.get(), buffer.size, buffer.offset, current_)) {
+      buffer.in_flight = true;
+      ++in_flight_;
+    } else {
+      if (!WriteAt({buffer.data.get(), buffer.size}, buffer.offset)) {
+        return false;
+      }
+      buffer.size = 0;
+    }
+
+    current_ = (current_ + 1) % kBuffers;
+    while (buffers_[current_].in_flight) {
+      if (!Reap()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Waits for one write to complete, and finishes it with pwrite if it came up short or io_uring rejected it.
+  bool Reap() {
+    const auto cqe = ring_->Wait();
+    if (!cqe) {
+      LOG_ERROR("Failed to wait for writes to {}, errno = {}", path_.string(), errno);
+      // Nothing more can be reaped, give up on the remaining writes.
+      for (auto& buffer : buffers_) {
+        buffer.in_flight = false;
+      }
+      in_flight_ = 0;
+      return false;
+    }
+    auto& buffer = buffers_[cqe->user_data];
+    buffer.in_flight = false;
+    --in_flight_;
+    const std::string_view data{buffer.data.get(), std::exchange(buffer.size, 0)};
+    if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+      // IORING_OP_WRITE needs Linux 5.6.
+      if (use_io_uring.exchange(false)) {
+        LOG_WARNING("io_uring rejected a write, errno = {}, write files with pwrite", -cqe->res);
+      }
+      return WriteAt(data, buffer.offset);
+    }
+    if (cqe->res < 0) {
+      LOG_ERROR("Failed to write {}, errno = {}", path_.string(), -cqe->res);
+      return false;
+    }
+    return WriteAt(data.substr(cqe->res), buffer.offset + cqe->res);
+  }
+
+  bool Drain() {
+    bool ok = true;
+    while (in_flight_ > 0) {
+      ok = Reap() && ok;
+    }
+    return ok;
+  }
+
+  int fd_{-1};
+  std::filesystem::path path_;
+  std::uint64_t written_{};
+  std::uint64_t synced_{};
+  XXH3_state_t hash_;
+  bool buffered_;
+  std::array<Buffer, kBuffers> buffers_{};
+  size_t current_{};
+  size_t in_flight_{};
+  std::unique_ptr<IoUring> ring_;
+};
+
+}  // namespace cielparser
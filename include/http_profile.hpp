@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cpr/cpr.h>
+
+#include <array>
+#include <cstddef>
+#include <format>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace cielparser {
+
+// Compile-time description of how a platform talks HTTP: the headers sent with every request and the extensions of
+// the Content-Types it serves. Headers are materialized into a cpr::Header once per profile, so building a request
+// does not rebuild the map from literals.
+
+struct HeaderField {
+  std::string_view name;
+  std::string_view value;
+};
+
+struct MimeExtension {
+  std::string_view mime;
+  std::string_view ext;
+};
+
+template <size_t NumHeaders, size_t NumMimeTypes = 0>
+struct HttpProfile {
+  std::array<HeaderField, NumHeaders> headers{};
+  std::array<MimeExtension, NumMimeTypes> mime_types{};
+  std::string_view default_ext{".bin"};
+
+  // The extension of the first entry whose mime is contained in content_type.
+  constexpr std::string_view ExtensionForMime(const std::string_view content_type) const {
+    for (const auto& [mime, ext] : mime_types) {
+      if (content_type.find(mime) != std::string_view::npos) {
+        return ext;
+      }
+    }
+    return default_ext;
+  }
+
+  constexpr std::string_view ExtensionForUrl(const std::string_view url) const;
+};
+
+template <const auto& Profile>
+const cpr::Header& StaticHeaders() {
+  static const cpr::Header headers = [] {
+    cpr::Header res;
+    for (const auto& [name, value] : Profile.headers) {
+      res.emplace(name, value);
+    }
+    return res;
+  }();
+  return headers;
+}
+
+// StaticHeaders<Profile> plus a per-request Referer, kept in a per-thread map so later requests on the thread reuse its
+// nodes and string capacity.
+template <const auto& Profile>
+const cpr::Header& StaticHeadersWithReferer(const std::string_view referer) {
+  static const std::string key = "Referer";
+  thread_local cpr::Header headers = StaticHeaders<Profile>();
+  headers[key].assign(referer);
+  return headers;
+}
+
+// Copies url into a per-thread cpr::Url that keeps its capacity, so handing it to Session::SetUrl, which reuses the
+// capacity of the session's own copy, does not allocate once both have grown to the usual URL length.
+inline const cpr::Url& ThreadUrl(const std::string_view url) {
+  thread_local cpr::Url buffer;
+  buffer.str().assign(url);
+  return buffer;
+}
+
+// Formats into a per-thread buffer that keeps its capacity. The view is valid until the next call on the same thread.
+template <class... Args>
+std::string_view FormatUrl(const std::format_string<Args...> fmt, Args&&... args) {
+  thread_local std::string buffer;
+  buffer.clear();
+  std::format_to(std::back_inserter(buffer), fmt, std::forward<Args>(args)...);
+  return buffer;
+}
+
+// The extension of the last path segment of url, query and fragment excluded, or an empty view if it has none.
+constexpr std::string_view ExtensionOf(const std::string_view url) {
+  const std::string_view path = url.substr(0, url.find_first_of("?#"));
+  const size_t dot = path.rfind('.');
+  if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) {
+    return {};
+  }
+  return path.substr(dot);
+}
+
+template <size_t NumHeaders, size_t NumMimeTypes>
+constexpr std::string_view HttpProfile<NumHeaders, NumMimeTypes>::ExtensionForUrl(const std::string_view url) const {
+  const std::string_view ext = ExtensionOf(url);
+  return ext.empty() ? default_ext : ext;
+}
+
+}  // namespace cielparser
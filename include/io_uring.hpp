@@ -0,0 +1,157 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+
+namespace cielparser {
+
+// A minimal io_uring driven through the raw io_uring_setup and io_uring_enter system calls, enough to queue writes and
+// reap their completions from a single thread. Create returns nullptr where the kernel lacks io_uring or forbids it,
+// e.g. through seccomp or the io_uring_disabled sysctl, so callers fall back to synchronous writes.
+class IoUring {
+ public:
+  struct Completion {
+    std::uint64_t user_data{};
+    // Bytes written, or a negated errno.
+    std::int32_t res{};
+  };
+
+  static std::unique_ptr<IoUring> Create(const unsigned entries) {
+    io_uring_params params{};
+    const int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      return nullptr;
+    }
+    std::unique_ptr<IoUring> ring(new IoUring(fd));
+    if (!ring->Map(params)) {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  ~IoUring() {
+    if (sqes_ != MAP_FAILED) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    ::close(fd_);
+  }
+
+  // Queues a write of size bytes at offset and submits it. The data has to stay alive until its completion is reaped.
+  bool Write(const int fd, const void* data, const unsigned size, const std::uint64_t offset,
+             const std::uint64_t user_data) {
+    const unsigned tail = *sq_tail_;
+    const unsigned index = tail & *sq_mask_;
+    io_uring_sqe& sqe = sqes_[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uintptr_t>(data);
+    sqe.len = size;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+    sq_array_[index] = index;
+    std::atomic_ref(*sq_tail_).store(tail + 1, std::memory_order_release);
+
+    while (::syscall(__NR_io_uring_enter, fd_, 1, 0, 0, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        // Not consumed by the kernel, take it back.
+        std::atomic_ref(*sq_tail_).store(tail, std::memory_order_release);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Blocks until a completion is available, std::nullopt if waiting fails.
+  std::optional<Completion> Wait() {
+    while (true) {
+      const unsigned head = *cq_head_;
+      if (head != std::atomic_ref(*cq_tail_).load(std::memory_order_acquire)) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+        const Completion completion{cqe.user_data, cqe.res};
+        std::atomic_ref(*cq_head_).store(head + 1, std::memory_order_release);
+        return completion;
+      }
+      if (::syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+        return std::nullopt;
+      }
+    }
+  }
+
+ private:
+  explicit IoUring(const int fd) : fd_(fd) {}
+
+  bool Map(const io_uring_params& params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                      IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    cq_ring_ = single_mmap ? sq_ring_
+                           : ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                                    IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes =
+        ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto* sq = static_cast<char*>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  int fd_;
+  void* sq_ring_{MAP_FAILED};
+  void* cq_ring_{MAP_FAILED};
+  size_t sq_ring_size_{};
+  size_t cq_ring_size_{};
+  io_uring_sqe* sqes_{static_cast<io_uring_sqe*>(MAP_FAILED)};
+  size_t sqes_size_{};
+  unsigned* sq_tail_{};
+  unsigned* sq_mask_{};
+  unsigned* sq_array_{};
+  unsigned* cq_head_{};
+  unsigned* cq_tail_{};
+  unsigned* cq_mask_{};
+  io_uring_cqe* cqes_{};
+};
+
+}  // namespace cielparser
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "quill.hpp"
+
+namespace cielparser {
+
+// Append-only log of job state transitions: received -> resolved -> file (one per downloaded link) -> uploaded.
+// Records are buffered and written plus fdatasync'ed in batches by a background thread, which also rewrites the file
+// with only the unfinished jobs once enough records have been appended. With an empty path nothing is persisted.
+class Journal {
+ public:
+  struct Job {
+    std::uint64_t id{};
+    std::int64_t chat_id{};
+    std::int32_t message_id{};
+    std::string platform;
+    std::string url;
+    bool resolved{};
+    std::vector<std::string> links;
+    std::map<std::string, std::filesystem::path> files;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE(Job, id, chat_id, message_id, platform, url, resolved, links, files);
+  };
+
+  static constexpr size_t kCompactThreshold = 4096;
+  static constexpr auto kFlushInterval = std::chrono::milliseconds(50);
+
+  explicit Journal(std::filesystem::path path) : path_(std::move(path)) {
+    if (path_.empty()) {
+      return;
+    }
+    Replay();
+    Open();
+    flusher_ = std::jthread([this](const std::stop_token& stop) { Flush(stop); });
+  }
+
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  ~Journal() {
+    if (flusher_.joinable()) {
+      flusher_.request_stop();
+      flusher_.join();
+      ::close(fd_);
+    }
+  }
+
+  // Jobs that were not uploaded before the last shutdown.
+  std::vector<Job> Unfinished() const {
+    std::lock_guard lock(mutex_);
+    std::vector<Job> res;
+    res.reserve(jobs_.size());
+    for (const auto& job : jobs_ | std::views::values) {
+      res.emplace_back(job);
+    }
+    return res;
+  }
+
+  std::uint64_t Received(const std::int64_t chat_id, const std::int32_t message_id, const std::string_view platform,
+                         const std::string_view url) {
+    std::lock_guard lock(mutex_);
+    const std::uint64_t id = next_id_++;
+    Job job{.id = id,
+            .chat_id = chat_id,
+            .message_id = message_id,
+            .platform = std::string{platform},
+            .url = std::string{url}};
+    Append(nlohmann::json{{"type", "received"}, {"job", job}});
+    jobs_.emplace(id, std::move(job));
+    return id;
+  }
+
+  void Resolved(const std::uint64_t id, const std::vector<std::string>& links) {
+    std::lock_guard lock(mutex_);
+    if (const auto it = jobs_.find(id); it != jobs_.end()) {
+      it->second.resolved = true;
+      it->second.links = links;
+      Append(nlohmann::json{{"type", "resolved"}, {"id", id}, {"links", links}});
+    }
+  }
+
+  void Downloaded(const std::uint64_t id, const std::string_view link, const std::filesystem::path& file) {
+    std::lock_guard lock(mutex_);
+    if (const auto it = jobs_.find(id); it != jobs_.end()) {
+      it->second.files.emplace(link, file);
+      Append(nlohmann::json{{"type", "file"}, {"id", id}, {"link", link}, {"path", file}});
+    }
+  }
+
+  void Uploaded(const std::uint64_t id) {
+    std::lock_guard lock(mutex_);
+    if (jobs_.erase(id) != 0) {
+      Append(nlohmann::json{{"type", "uploaded"}, {"id", id}});
+    }
+  }
+
+  std::optional<std::vector<std::string>> ResolvedLinks(const std::uint64_t id) const {
+    std::lock_guard lock(mutex_);
+    if (const auto it = jobs_.find(id); it != jobs_.end() && it->second.resolved) {
+      return it->second.links;
+    }
+    return std::nullopt;
+  }
+
+  // A file downloaded from link by any unfinished job that still exists on disk.
+  std::optional<std::filesystem::path> FindFile(const std::string_view link) const {
+    std::lock_guard lock(mutex_);
+    for (const auto& job : jobs_ | std::views::values) {
+      if (const auto it = job.files.find(std::string{link});
+          it != job.files.end() && std::filesystem::exists(it->second)) {
+        return it->second;
+      }
+    }
+    return std::nullopt;
+  }
+
+ private:
+  void Replay() {
+    std::ifstream ifs(path_);
+    size_t line_no = 0;
+    // End of the last line terminated by a newline.
+    std::uintmax_t complete = 0;
+    for (std::string line; std::getline(ifs, line); ++line_no) {
+      if (ifs.eof()) {
+        // A crash in the middle of a write leaves a torn last record behind. It is cut off so that the next record
+        // appended does not run into it.
+        LOG_WARNING("Drop torn journal record at line {} of {}", line_no + 1, path_.string());
+        ifs.close();
+        std::error_code ec;
+        std::filesystem::resize_file(path_, complete, ec);
+        if (ec) {
+          throw std::runtime_error(std::format("Failed to truncate journal {}: {}", path_.string(), ec.message()));
+        }
+        break;
+      }
+      complete += line.size() + 1;
+      try {
+        const auto record = nlohmann::json::parse(line);
+        const auto type = record["type"].get<std::string>();
+        if (type == "received") {
+          auto job = record["job"].get<Job>();
+          next_id_ = std::max(next_id_, job.id + 1);
+          jobs_.insert_or_assign(job.id, std::move(job));
+          continue;
+        }
+
+        const auto it = jobs_.find(record["id"].get<std::uint64_t>());
+        if (it == jobs_.end()) {
+          continue;
+        }
+        if (type == "resolved") {
+          it->second.resolved = true;
+          it->second.links = record["links"].get<std::vector<std::string>>();
+        } else if (type == "file") {
+          it->second.files.insert_or_assign(record["link"].get<std::string>(), record["path"].get<std::string>());
+        } else if (type == "uploaded") {
+          jobs_.erase(it);
+        }
+      } catch (const std::exception& e) {
+        LOG_WARNING("Skip journal record at line {} of {}: {}", line_no + 1, path_.string(), e.what());
+      }
+    }
+    records_ = line_no;
+    LOG_INFO("Replayed journal {}, {} unfinished jobs", path_.string(), jobs_.size());
+  }
+
+  void Open() {
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error(std::format("Failed to open journal {}", path_.string()));
+    }
+  }
+
+  // Called with mutex_ held.
+  void Append(const nlohmann::json& record) {
+    if (path_.empty()) {
+      return;
+    }
+    pending_ += record.dump();
+    pending_ += '\n';
+    ++records_;
+    cv_.notify_one();
+  }
+
+  void Flush(const std::stop_token& stop) {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      cv_.wait(lock, stop, [&] { return !pending_.empty(); });
+      const bool stopping = stop.stop_requested();
+      if (!stopping) {
+        // Let more records accumulate so one fdatasync covers the whole batch.
+        cv_.wait_for(lock, stop, kFlushInterval, [] { return false; });
+      }
+
+      if (!pending_.empty()) {
+        std::string batch = std::move(pending_);
+        pending_.clear();
+        lock.unlock();
+        WriteAll(batch);
+        lock.lock();
+      }
+
+      if (records_ >= kCompactThreshold && records_ >= jobs_.size() * 4) {
+        Compact(lock);
+      }
+      if (stopping) {
+        return;
+      }
+    }
+  }
+
+  void WriteAll(const std::string_view data) const {
+    for (size_t written = 0; written < data.size();) {
+      const ssize_t n = ::write(fd_, data.data() + written, data.size() - written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_ERROR("Failed to write journal {}, errno = {}", path_.string(), errno);
+        return;
+      }
+      written += n;
+    }
+    ::fdatasync(fd_);
+  }
+
+  // Called with lock held. The snapshot is taken under the lock and already reflects every pending record, so those
+  // are dropped; it is written without the lock, so that recording jobs does not wait for the rewrite. Records appended
+  // meanwhile stay pending and go to the new file.
+  void Compact(std::unique_lock<std::mutex>& lock) {
+    const std::string covered = std::exchange(pending_, {});
+    const size_t before = records_;
+    const auto jobs = jobs_;
+    records_ = jobs.size();
+    lock.unlock();
+
+    auto tmp_path = path_;
+    tmp_path += ".tmp";
+    bool written = false;
+    {
+      std::ofstream ofs(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+      for (const auto& job : jobs | std::views::values) {
+        ofs << nlohmann::json{{"type", "received"}, {"job", job}}.dump() << '\n';
+      }
+      written = static_cast<bool>(ofs.flush());
+    }
+    int fd = -1;
+    if (written) {
+      const int tmp_fd = ::open(tmp_path.c_str(), O_WRONLY | O_CLOEXEC);
+      ::fdatasync(tmp_fd);
+      ::close(tmp_fd);
+      std::error_code ec;
+      std::filesystem::rename(tmp_path, path_, ec);
+      fd = ec ? -1 : ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+
+    lock.lock();
+    if (fd < 0) {
+      LOG_ERROR("Failed to compact journal {}", path_.string());
+      pending_.insert(0, covered);
+      records_ += before - jobs.size();
+      return;
+    }
+    ::close(std::exchange(fd_, fd));
+    LOG_INFO("Compacted journal {} from {} records to {}", path_.string(), before, jobs.size());
+  }
+
+  std::filesystem::path path_;
+  int fd_{-1};
+  mutable std::mutex mutex_;
+  std::condition_variable_any cv_;
+  std::map<std::uint64_t, Job> jobs_;
+  std::uint64_t next_id_{};
+  std::string pending_;
+  size_t records_{};
+  std::jthread flusher_;
+};
+
+}  // namespace cielparser
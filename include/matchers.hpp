@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace cielparser {
+
+// Allocation-free constexpr replacements of the std::regex extractions used by the platform resolvers. Each returns a
+// view into its input, or an empty view when nothing matches.
+
+constexpr bool IsDigit(const char c) { return c >= '0' && c <= '9'; }
+
+constexpr bool IsLowerHex(const char c) { return IsDigit(c) || (c >= 'a' && c <= 'f'); }
+
+constexpr bool IsAlnum(const char c) { return IsDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+// (?:marker)(\d+)
+constexpr std::string_view FindDigitsAfter(const std::string_view s, const std::string_view marker) {
+  for (size_t pos = s.find(marker); pos != std::string_view::npos; pos = s.find(marker, pos + 1)) {
+    const size_t begin = pos + marker.size();
+    size_t end = begin;
+    while (end < s.size() && IsDigit(s[end])) {
+      ++end;
+    }
+    if (end > begin) {
+      return s.substr(begin, end - begin);
+    }
+  }
+  return {};
+}
+
+// BV[a-zA-Z0-9]{10}
+constexpr std::string_view FindBvid(const std::string_view s) {
+  constexpr size_t id_size = 12;
+  for (size_t pos = s.find("BV"); pos != std::string_view::npos; pos = s.find("BV", pos + 1)) {
+    if (pos + id_size > s.size()) {
+      break;
+    }
+    bool ok = true;
+    for (size_t i = pos + 2; i < pos + id_size && ok; ++i) {
+      ok = IsAlnum(s[i]);
+    }
+    if (ok) {
+      return s.substr(pos, id_size);
+    }
+  }
+  return {};
+}
+
+// /[0-9a-f]{32}/(.+?)!
+constexpr std::string_view FindXhsImageKey(const std::string_view s) {
+  constexpr size_t hash_size = 32;
+  for (size_t pos = s.find('/'); pos != std::string_view::npos; pos = s.find('/', pos + 1)) {
+    const size_t key_begin = pos + hash_size + 2;
+    if (key_begin > s.size()) {
+      break;
+    }
+    bool ok = s[key_begin - 1] == '/';
+    for (size_t i = pos + 1; i < key_begin - 1 && ok; ++i) {
+      ok = IsLowerHex(s[i]);
+    }
+    if (!ok) {
+      continue;
+    }
+    if (const size_t key_end = s.find('!', key_begin + 1); key_end != std::string_view::npos) {
+      return s.substr(key_begin, key_end - key_begin);
+    }
+  }
+  return {};
+}
+
+// A Weibo post ID, either the numeric mid or its base62 form, which spells the mid in groups of seven decimal digits
+// with four base62 characters each. Returns the mid, or 0 if id is neither.
+constexpr std::uint64_t WeiboMid(const std::string_view id) {
+  constexpr std::string_view alphabet = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  constexpr std::uint64_t group_base = 10'000'000;
+  if (id.empty() || id.size() > 19) {
+    return 0;
+  }
+  std::uint64_t mid = 0;
+  if (std::ranges::all_of(id, IsDigit)) {
+    for (const char c : id) {
+      mid = mid * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    return mid;
+  }
+  if (id.size() > 12) {
+    return 0;
+  }
+  for (size_t begin = 0, end = (id.size() - 1) % 4 + 1; begin < id.size(); begin = end, end += 4) {
+    std::uint64_t group = 0;
+    for (const char c : id.substr(begin, end - begin)) {
+      const size_t digit = alphabet.find(c);
+      if (digit == std::string_view::npos) {
+        return 0;
+      }
+      group = group * alphabet.size() + digit;
+    }
+    if (begin > 0 && group >= group_base) {
+      return 0;
+    }
+    mid = mid * group_base + group;
+  }
+  return mid;
+}
+
+static_assert(FindDigitsAfter("https://www.pixiv.net/artworks/123456?p=1", "artworks/") == "123456");
+static_assert(FindDigitsAfter("https://x.com/a/status/987/photo/1", "status/") == "987");
+static_assert(FindDigitsAfter("https://x.com/status/a/status/42", "status/") == "42");
+static_assert(FindDigitsAfter("https://x.com/home", "status/").empty());
+static_assert(WeiboMid("NAMhW4fm9") == 4987654321012345);
+static_assert(WeiboMid("4987654321012345") == 4987654321012345);
+static_assert(WeiboMid("O5b9i0w7e") == 5012345000123456);
+static_assert(WeiboMid("a-b") == 0);
+static_assert(FindBvid("https://www.bilibili.com/video/BV1xx411c7mD?p=2") == "BV1xx411c7mD");
+static_assert(FindBvid("BVshort/BV1234567890") == "BV1234567890");
+static_assert(FindBvid("https://b23.tv/abc").empty());
+static_assert(FindXhsImageKey("http://sns-webpic-qc.xhscdn.com/202401/0123456789abcdef0123456789abcdef/"
+                              "1040g2sg30u!nd_dft_wlteh_webp_3") == "1040g2sg30u");
+static_assert(FindXhsImageKey("http://sns-webpic-qc.xhscdn.com/0123456789abcdef/1040g!nd").empty());
+
+// Replaces the JavaScript-only :undefined values with :null so the state can be parsed as JSON.
+inline std::string SanitizeJson(const std::string_view raw) {
+  constexpr std::string_view from = ":undefined";
+  constexpr std::string_view to = ":null";
+  std::string res;
+  res.reserve(raw.size());
+  size_t begin = 0;
+  for (size_t pos = raw.find(from); pos != std::string_view::npos; pos = raw.find(from, begin)) {
+    res.append(raw.substr(begin, pos - begin)).append(to);
+    begin = pos + from.size();
+  }
+  res.append(raw.substr(begin));
+  return res;
+}
+
+}  // namespace cielparser
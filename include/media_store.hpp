@@ -0,0 +1,182 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "quill.hpp"
+
+namespace cielparser {
+
+// Downloads are stored by content: a finished file is hardlinked to <XXH3-128 digest><ext> next to it and its
+// temporary name is dropped. The link is claimed atomically, so when the same media arrives again under another URL
+// (an image variant, a mirror, a CDN host with a different signature) the new copy is discarded in favour of the
+// object that already exists. Objects are never rewritten, so any number of jobs may refer to one.
+struct MediaStore {
+  struct Stats {
+    std::uint64_t duplicate_files;
+    std::uint64_t duplicate_bytes;
+  };
+
+  static std::string ObjectName(const XXH128_hash_t digest, const std::string_view ext) {
+    return std::format("{:016x}{:016x}{}", digest.high64, digest.low64, ext);
+  }
+
+  static bool IsObject(const std::filesystem::path& file) {
+    const std::string stem = file.stem().string();
+    return stem.size() == 32 && std::ranges::all_of(stem, [](const unsigned char c) { return std::isxdigit(c); });
+  }
+
+  // Moves file to its object. Returns the object, or file itself if it could not be linked.
+  static std::filesystem::path Adopt(const std::filesystem::path& file, const XXH128_hash_t digest) {
+    auto object = file.parent_path() / ObjectName(digest, file.extension().string());
+    const int rc = ::link(file.c_str(), object.c_str());
+    const bool duplicate = rc != 0 && errno == EEXIST;
+    if (rc != 0 && !duplicate) {
+      LOG_WARNING("Failed to link {} to {}, errno = {}", file.string(), object.string(), errno);
+      return file;
+    }
+
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(file, ec);
+    std::filesystem::remove(file, ec);
+    if (duplicate) {
+      ++duplicate_files_;
+      duplicate_bytes_ += size;
+      LOG_INFO("{} has the same contents as {}, keep one copy", file.string(), object.string());
+    }
+    return object;
+  }
+
+  static Stats GetStats() { return {duplicate_files_.load(), duplicate_bytes_.load()}; }
+
+ private:
+  inline static std::atomic<std::uint64_t> duplicate_files_{};
+  inline static std::atomic<std::uint64_t> duplicate_bytes_{};
+};
+
+// Telegram file_ids of uploaded media, keyed by object name, so a file that was uploaded once is sent by reference
+// afterwards, whichever URL it came from. Entries are appended to a JSONL file shared by the bot and its workers; lines
+// appended by other processes are read in when a lookup misses. With an empty path nothing is persisted.
+class FileIdIndex {
+ public:
+  struct Stats {
+    size_t entries;
+    std::uint64_t hits;
+  };
+
+  explicit FileIdIndex(std::filesystem::path path) : path_(std::move(path)) {
+    if (path_.empty()) {
+      return;
+    }
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      LOG_ERROR("Failed to open file_id index {}, errno = {}", path_.string(), errno);
+      return;
+    }
+    std::lock_guard lock(mutex_);
+    CatchUp();
+    LOG_INFO("Loaded file_id index {}, {} entries", path_.string(), ids_.size());
+  }
+
+  FileIdIndex(const FileIdIndex&) = delete;
+  FileIdIndex& operator=(const FileIdIndex&) = delete;
+
+  ~FileIdIndex() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  std::optional<std::string> Find(const std::string& key) {
+    std::lock_guard lock(mutex_);
+    auto it = ids_.find(key);
+    if (it == ids_.end()) {
+      CatchUp();
+      it = ids_.find(key);
+    }
+    if (it == ids_.end()) {
+      return std::nullopt;
+    }
+    ++hits_;
+    return it->second;
+  }
+
+  void Add(const std::string& key, const std::string& file_id) {
+    std::lock_guard lock(mutex_);
+    if (const auto [it, inserted] = ids_.try_emplace(key, file_id); !inserted) {
+      if (it->second == file_id) {
+        return;
+      }
+      it->second = file_id;
+    }
+    if (fd_ < 0) {
+      return;
+    }
+    // One write per line, which O_APPEND keeps from interleaving with the other processes.
+    const std::string line = nlohmann::json{{"key", key}, {"file_id", file_id}}.dump() + '\n';
+    if (::write(fd_, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+      LOG_ERROR("Failed to append to file_id index {}, errno = {}", path_.string(), errno);
+    }
+  }
+
+  Stats GetStats() const {
+    std::lock_guard lock(mutex_);
+    return {ids_.size(), hits_};
+  }
+
+ private:
+  // Called with mutex_ held. Reads the complete lines appended since the last call.
+  void CatchUp() {
+    if (fd_ < 0) {
+      return;
+    }
+    std::array<char, 1 << 16> buffer;
+    while (true) {
+      const ssize_t n = ::pread(fd_, buffer.data(), buffer.size(), static_cast<off_t>(offset_ + partial_.size()));
+      if (n <= 0) {
+        break;
+      }
+      partial_.append(buffer.data(), n);
+    }
+
+    std::string_view pending{partial_};
+    for (size_t eol; (eol = pending.find('\n')) != std::string_view::npos; pending.remove_prefix(eol + 1)) {
+      try {
+        const auto record = nlohmann::json::parse(pending.substr(0, eol));
+        ids_.insert_or_assign(record["key"].get<std::string>(), record["file_id"].get<std::string>());
+      } catch (const std::exception& e) {
+        LOG_WARNING("Skip file_id index record at offset {} of {}: {}", offset_, path_.string(), e.what());
+      }
+      offset_ += eol + 1;
+    }
+    partial_.erase(0, partial_.size() - pending.size());
+  }
+
+  std::filesystem::path path_;
+  int fd_{-1};
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::string> ids_;
+  std::uint64_t hits_{};
+  std::uint64_t offset_{};
+  std::string partial_;
+};
+
+}  // namespace cielparser
@@ -9,6 +9,7 @@
 #include <string_view>
 #include <vector>
 
+#include "matchers.hpp"
 #include "quill.hpp"
 #include "utils.hpp"
 
@@ -16,50 +17,48 @@ namespace cielparser {
 
 class Pixiv {
   inline static const std::regex url_pattern{R"(https?://(?:www\.)?pixiv\.net/artworks/\d+)"};
+  static constexpr HttpProfile<2> http_profile{
+      .headers = {{{"User-Agent", "Mozilla/5.0"}, {"Referer", "https://www.pixiv.net/"}}}};
 
  public:
   static constexpr std::string_view NAME = "Pixiv";
+  static constexpr size_t JOB_COST = 1;
 
   static std::vector<std::string> GetUrls(const std::string_view message) {
     return GetMatchedUrlsFromPattern(message, url_pattern);
   }
 
-  static std::vector<std::string> GetDownloadLinks(const std::string_view url) {
-    std::vector<std::string> res;
+  static std::string PostKey(const std::string_view url) {
+    const std::string_view id = FindDigitsAfter(url, "artworks/");
+    return id.empty() ? CanonicalUrlKey(NAME, url) : std::format("{}:{}", NAME, id);
+  }
 
+  static void GetDownloadLinks(const std::string_view url, const LinkSink& emit) {
     try {
-      const std::regex re(R"(artworks/(\d+))");
-      std::cmatch m;
-      if (!std::regex_search(url.begin(), url.end(), m, re)) {
-        LOG_ERROR("regex_search failed, url: {} ", url);
-        return res;
+      const std::string_view id = FindDigitsAfter(url, "artworks/");
+      if (id.empty()) {
+        LOG_ERROR("Artwork id not found, url: {} ", url);
+        return;
       }
 
-      const auto r = HttpGet(std::format("https://www.pixiv.net/ajax/illust/{}/pages", m[1].str()),
-                             {{"User-Agent", "Mozilla/5.0"}, {"Referer", "https://www.pixiv.net/"}});
+      const auto r =
+          HttpGet(FormatUrl("https://www.pixiv.net/ajax/illust/{}/pages", id), StaticHeaders<http_profile>());
       if (!r) {
-        return res;
+        return;
       }
 
       for (const auto json = nlohmann::json::parse(r->text); const auto& item : json["body"]) {
-        res.emplace_back(item["urls"]["original"].get<std::string>());
+        emit(item["urls"]["original"].get<std::string>());
       }
     } catch (const std::exception& e) {
       LOG_ERROR("Failed to get download links for {}: {}", url, e.what());
     }
-
-    return res;
   }
 
   static std::optional<std::filesystem::path> DownloadFile(const std::string_view download_link,
                                                            const std::filesystem::path& download_dir) {
-    const auto r = HttpGet(download_link, {{"User-Agent", "Mozilla/5.0"}, {"Referer", "https://www.pixiv.net/"}});
-    if (!r) {
-      return std::nullopt;
-    }
-
-    const auto ext = std::filesystem::path(download_link).extension().string();
-    return SaveContents(download_dir, ext, download_link, r->text);
+    return HttpDownload(download_link, download_dir, http_profile.ExtensionForUrl(download_link),
+                        StaticHeaders<http_profile>());
   }
 };
 
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "quill.hpp"
+
+namespace cielparser {
+
+// Deficit round robin over chats, and round robin over users inside a chat. Within its turn a chat dispatches its jobs
+// whose cost is at most small_job_cost ahead of its large ones, and a chat never runs more than per_chat_concurrency
+// jobs.
+class FairScheduler {
+ public:
+  struct Options {
+    size_t workers{16};
+    size_t per_chat_concurrency{4};
+    size_t small_job_cost{1};
+    size_t quantum{4};
+  };
+
+  struct WaitStats {
+    size_t dispatched{};
+    std::chrono::milliseconds total_wait{};
+    std::chrono::milliseconds max_wait{};
+  };
+
+  struct Stats {
+    size_t queued{};
+    size_t running{};
+    WaitStats total;
+    std::map<std::int64_t, WaitStats> chats;
+  };
+
+  explicit FairScheduler(const Options& options) : options_(options) {
+    workers_.reserve(options_.workers);
+    for (size_t i = 0; i < options_.workers; ++i) {
+      workers_.emplace_back([this](const std::stop_token& stop) { Work(stop); });
+    }
+  }
+
+  FairScheduler(const FairScheduler&) = delete;
+  FairScheduler& operator=(const FairScheduler&) = delete;
+
+  ~FairScheduler() {
+    for (auto& worker : workers_) {
+      worker.request_stop();
+    }
+    cv_.notify_all();
+  }
+
+  using Release = std::function<void()>;
+
+  void Submit(const std::int64_t chat_id, const std::int64_t user_id, const size_t cost, std::function<void()> work) {
+    Enqueue(chat_id, user_id, cost, [work = std::move(work)](const Release&) { work(); }, /*deferred=*/false);
+  }
+
+  // Like Submit, but the job keeps its place in its chat's concurrency after work returns, until the release handed to
+  // work is called, possibly from another thread. The worker thread is free again as soon as work returns.
+  void SubmitDeferred(const std::int64_t chat_id, const std::int64_t user_id, const size_t cost,
+                      std::function<void(Release)> work) {
+    Enqueue(chat_id, user_id, cost, std::move(work), /*deferred=*/true);
+  }
+
+  // The per-chat waits cover the chats dispatched since the previous call only, so chats that went quiet are dropped.
+  Stats GetStats() {
+    std::lock_guard lock(mutex_);
+    return Stats{.queued = queued_, .running = running_, .total = total_wait_, .chats = std::exchange(chat_wait_, {})};
+  }
+
+ private:
+  struct Job {
+    std::function<void(Release)> work;
+    size_t cost{};
+    bool deferred{};
+    std::chrono::steady_clock::time_point enqueued;
+  };
+
+  void Enqueue(const std::int64_t chat_id, const std::int64_t user_id, const size_t cost,
+               std::function<void(Release)> work, const bool deferred) {
+    {
+      std::lock_guard lock(mutex_);
+      auto& chat = chats_[chat_id];
+      auto& user = chat.users[user_id];
+      if (user.small.empty() && user.large.empty()) {
+        chat.user_ring.push_back(user_id);
+      }
+      if (chat.queued == 0) {
+        chat_ring_.push_back(chat_id);
+      }
+      (cost <= options_.small_job_cost ? user.small : user.large)
+          .push_back(Job{std::move(work), cost, deferred, std::chrono::steady_clock::now()});
+      ++chat.queued;
+      ++queued_;
+    }
+    cv_.notify_one();
+  }
+
+  struct User {
+    std::deque<Job> small;
+    std::deque<Job> large;
+  };
+
+  struct Chat {
+    std::unordered_map<std::int64_t, User> users;
+    std::deque<std::int64_t> user_ring;
+    size_t queued{};
+    size_t running{};
+    size_t deficit{};
+  };
+
+  void Work(const std::stop_token& stop) {
+    while (true) {
+      std::int64_t chat_id{};
+      Job job;
+      {
+        std::unique_lock lock(mutex_);
+        std::optional<std::pair<std::int64_t, Job>> next;
+        if (!cv_.wait(lock, stop, [&] { return (next = PopNext()).has_value(); })) {
+          return;
+        }
+        std::tie(chat_id, job) = std::move(*next);
+      }
+
+      // Releasing twice, say from a deferred job that handed its release on and then threw, is harmless.
+      Release release = [this, chat_id, released = std::make_shared<std::atomic<bool>>(false)] {
+        if (!released->exchange(true)) {
+          Finish(chat_id);
+        }
+      };
+      try {
+        job.work(release);
+        if (!job.deferred) {
+          release();
+        }
+      } catch (const std::exception& e) {
+        LOG_ERROR("exception caught in scheduled job of chat {}: {}", chat_id, e.what());
+        release();
+      }
+    }
+  }
+
+  void Finish(const std::int64_t chat_id) {
+    {
+      std::lock_guard lock(mutex_);
+      --running_;
+      auto& chat = chats_[chat_id];
+      --chat.running;
+      if (chat.running == 0 && chat.queued == 0) {
+        chats_.erase(chat_id);
+      }
+    }
+    cv_.notify_all();
+  }
+
+  // Called with mutex_ held. Chats take turns first; within its turn a chat runs its small jobs ahead of its large
+  // ones. Every job is charged to its chat's deficit, which grows by one quantum per turn the chat cannot afford its
+  // next job, so a chat sending many cheap jobs cannot hold back the expensive jobs of other chats.
+  std::optional<std::pair<std::int64_t, Job>> PopNext() {
+    for (bool eligible = true; eligible;) {
+      eligible = false;
+      for (size_t i = 0, n = chat_ring_.size(); i < n; ++i) {
+        const std::int64_t chat_id = chat_ring_.front();
+        chat_ring_.pop_front();
+        chat_ring_.push_back(chat_id);
+
+        auto& chat = chats_[chat_id];
+        if (chat.running >= options_.per_chat_concurrency) {
+          continue;
+        }
+
+        auto user_it = std::ranges::find_if(
+            chat.user_ring, [&](const std::int64_t user_id) { return !chat.users[user_id].small.empty(); });
+        if (user_it == chat.user_ring.end()) {
+          user_it = chat.user_ring.begin();
+        }
+        if (user_it == chat.user_ring.end()) {
+          continue;
+        }
+
+        eligible = true;
+        auto& user = chat.users[*user_it];
+        auto& queue = user.small.empty() ? user.large : user.small;
+        if (queue.front().cost > chat.deficit) {
+          chat.deficit += options_.quantum;
+          continue;
+        }
+
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        chat.deficit -= job.cost;
+
+        const std::int64_t user_id = *user_it;
+        chat.user_ring.erase(user_it);
+        if (user.small.empty() && user.large.empty()) {
+          chat.users.erase(user_id);
+        } else {
+          chat.user_ring.push_back(user_id);
+        }
+
+        --chat.queued;
+        ++chat.running;
+        --queued_;
+        ++running_;
+        if (chat.queued == 0) {
+          chat.deficit = 0;
+          std::erase(chat_ring_, chat_id);
+        }
+
+        const auto wait =
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - job.enqueued);
+        for (WaitStats* stats : {&chat_wait_[chat_id], &total_wait_}) {
+          ++stats->dispatched;
+          stats->total_wait += wait;
+          stats->max_wait = std::max(stats->max_wait, wait);
+        }
+        LOG_INFO("Dispatched job of chat {} with cost {} after waiting {}ms", chat_id, job.cost, wait.count());
+        return std::pair{chat_id, std::move(job)};
+      }
+    }
+    return std::nullopt;
+  }
+
+  Options options_;
+  mutable std::mutex mutex_;
+  std::condition_variable_any cv_;
+  std::unordered_map<std::int64_t, Chat> chats_;
+  std::deque<std::int64_t> chat_ring_;
+  size_t queued_{};
+  size_t running_{};
+  WaitStats total_wait_;
+  std::map<std::int64_t, WaitStats> chat_wait_;
+  std::vector<std::jthread> workers_;
+};
+
+}  // namespace cielparser
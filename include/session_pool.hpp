@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cpr/cpr.h>
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "curl_multi.hpp"
+#include "deadline.hpp"
+#include "quill.hpp"
+
+namespace cielparser {
+
+// A cpr::Session that remembers the headers it was last given. cpr copies the whole map on every SetHeader, which
+// reallocates each value longer than the small string buffer, so a pooled session skips the copy when the next request
+// sends the same headers.
+class PooledSession : public cpr::Session {
+ public:
+  void SetHeader(const cpr::Header& header) {
+    if (header != header_) {
+      cpr::Session::SetHeader(header);
+      header_ = header;
+    }
+  }
+
+  // Drops the callbacks of the last request, which usually point into the stack frame of its caller.
+  void ResetCallbacks() {
+    SetWriteCallback(cpr::WriteCallback{});
+    SetHeaderCallback(cpr::HeaderCallback{});
+    SetProgressCallback(cpr::ProgressCallback{[](auto, auto, auto, auto, std::intptr_t) { return true; }});
+  }
+
+ private:
+  cpr::Header header_;
+};
+
+// Reusable cpr sessions per origin. Requests run on CurlMulti::Shared(), whose connection cache keeps connections and
+// TLS state between requests, so the images of a gallery on one CDN host skip the handshake and slow start after the
+// first fetch. Sessions negotiate HTTP/2 through ALPN and fall back to HTTP/1.1; a request waits for a connection that
+// is still being set up rather than opening its own, so concurrent requests to one host multiplex over a single
+// HTTP/2 connection. DNS and TLS session caches are shared as well. At most max_per_origin requests to one origin run
+// at the same time; further callers wait for a session to come back. Sessions idle for longer than kIdleTimeout are
+// closed, and an origin is forgotten once it has neither.
+class SessionPool {
+  using Clock = std::chrono::steady_clock;
+
+  struct IdleSession {
+    std::unique_ptr<PooledSession> session;
+    Clock::time_point since;
+  };
+
+  struct Origin {
+    size_t leased{};
+    size_t waiting{};
+    // Oldest first.
+    std::vector<IdleSession> idle;
+  };
+
+  struct OriginHash : std::hash<std::string_view> {
+    using is_transparent = void;
+  };
+
+ public:
+  struct Stats {
+    std::uint64_t requests;
+    std::uint64_t new_connections;
+    std::uint64_t http2;
+  };
+
+  static constexpr std::chrono::seconds kIdleTimeout{60};
+
+  class Lease {
+   public:
+    Lease(SessionPool& pool, Origin& origin, std::unique_ptr<PooledSession> session)
+        : pool_(&pool), origin_(&origin), session_(std::move(session)) {}
+
+    Lease(Lease&&) noexcept = default;
+    Lease& operator=(Lease&&) = delete;
+
+    ~Lease() {
+      if (session_) {
+        session_->ResetCallbacks();
+        pool_->Release(*origin_, std::move(session_));
+      }
+    }
+
+    PooledSession& session() { return *session_; }
+
+    cpr::Response Get() {
+      session_->PrepareGet();
+      return Perform();
+    }
+
+    cpr::Response Head() {
+      session_->PrepareHead();
+      return Perform();
+    }
+
+   private:
+    cpr::Response Perform() {
+      auto r = session_->Complete(CurlMulti::Shared().Perform(session_->GetCurlHolder()->handle));
+      pool_->Count(*session_);
+      return r;
+    }
+
+    SessionPool* pool_;
+    Origin* origin_;
+    std::unique_ptr<PooledSession> session_;
+  };
+
+  void SetMaxPerOrigin(const size_t max_per_origin) {
+    {
+      std::lock_guard lock(mutex_);
+      max_per_origin_ = max_per_origin;
+    }
+    cv_.notify_all();
+  }
+
+  // Waits for a session to the origin of url. Returns std::nullopt if the job is cancelled or past its deadline first.
+  std::optional<Lease> Acquire(const std::string_view url, const JobContext& context = JobContext::Current()) {
+    const std::string_view origin = OriginOf(url);
+    std::unique_ptr<PooledSession> session;
+    Origin* slot{};
+    {
+      std::unique_lock lock(mutex_);
+      // Look up by view first so that only the first request to an origin allocates its key.
+      auto it = origins_.find(origin);
+      if (it == origins_.end()) {
+        it = origins_.emplace(origin, Origin{}).first;
+      }
+      slot = &it->second;
+      ++slot->waiting;
+      const bool leased = cv_.wait_until(lock, context.stop(), context.deadline(),
+                                         [&] { return max_per_origin_ == 0 || slot->leased < max_per_origin_; });
+      --slot->waiting;
+      if (!leased) {
+        return std::nullopt;
+      }
+      ++slot->leased;
+      if (!slot->idle.empty()) {
+        session = std::move(slot->idle.back().session);
+        slot->idle.pop_back();
+      }
+    }
+    if (!session) {
+      session = MakeSession();
+    }
+    return std::optional<Lease>{std::in_place, *this, *slot, std::move(session)};
+  }
+
+  // Connects to every origin concurrently so the first jobs find warm connections.
+  void Warm(const std::span<const std::string_view> origins) {
+    std::vector<std::jthread> threads;
+    threads.reserve(origins.size());
+    for (const auto origin : origins) {
+      threads.emplace_back([this, origin] {
+        auto lease = Acquire(origin);
+        if (!lease) {
+          return;
+        }
+        lease->session().SetUrl(cpr::Url{std::string{origin} + '/'});
+        lease->session().SetHeader({});
+        lease->session().SetTimeout(cpr::Timeout{std::chrono::seconds(10)});
+        const auto r = lease->Head();
+        LOG_INFO("Warmed {}, status_code = {}, elapsed {:.0f}ms", origin, r.status_code, r.elapsed * 1000);
+      });
+    }
+  }
+
+  Stats GetStats() const { return {requests_.load(), new_connections_.load(), http2_.load()}; }
+
+ private:
+  static std::string_view OriginOf(const std::string_view url) {
+    const size_t scheme_end = url.find("://");
+    const size_t host_begin = scheme_end == std::string_view::npos ? 0 : scheme_end + 3;
+    return url.substr(0, url.find_first_of("/?#", host_begin));
+  }
+
+  static CURLSH* Share() {
+    static std::array<std::mutex, CURL_LOCK_DATA_LAST> locks;
+    static CURLSH* const share = [] {
+      CURLSH* share = curl_share_init();
+      curl_share_setopt(share, CURLSHOPT_LOCKFUNC,
+                        +[](CURL*, const curl_lock_data data, curl_lock_access, void*) { locks[data].lock(); });
+      curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, +[](CURL*, const curl_lock_data data, void*) {
+        locks[data].unlock();
+      });
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+      return share;
+    }();
+    return share;
+  }
+
+  static std::unique_ptr<PooledSession> MakeSession() {
+    auto session = std::make_unique<PooledSession>();
+    session->SetHttpVersion(cpr::HttpVersion{cpr::HttpVersionCode::VERSION_2_0_TLS});
+    curl_easy_setopt(session->GetCurlHolder()->handle, CURLOPT_SHARE, Share());
+    curl_easy_setopt(session->GetCurlHolder()->handle, CURLOPT_PIPEWAIT, 1L);
+    return session;
+  }
+
+  void Release(Origin& slot, std::unique_ptr<PooledSession> session) {
+    std::vector<IdleSession> expired;
+    {
+      std::lock_guard lock(mutex_);
+      const auto now = Clock::now();
+      --slot.leased;
+      slot.idle.push_back({std::move(session), now});
+      expired = Expire(now);
+    }
+    cv_.notify_all();
+  }
+
+  // Called with mutex_ held, at most once per second. Takes out the sessions idle for longer than kIdleTimeout and
+  // drops the origins left unused; the caller closes the sessions after unlocking.
+  std::vector<IdleSession> Expire(const Clock::time_point now) {
+    std::vector<IdleSession> expired;
+    if (now < next_expiry_) {
+      return expired;
+    }
+    next_expiry_ = now + std::chrono::seconds(1);
+    for (auto it = origins_.begin(); it != origins_.end();) {
+      auto& [leased, waiting, idle] = it->second;
+      const auto fresh = std::ranges::find_if(idle, [&](const IdleSession& s) { return now - s.since < kIdleTimeout; });
+      expired.insert(expired.end(), std::make_move_iterator(idle.begin()), std::make_move_iterator(fresh));
+      idle.erase(idle.begin(), fresh);
+      it = leased == 0 && waiting == 0 && idle.empty() ? origins_.erase(it) : std::next(it);
+    }
+    return expired;
+  }
+
+  void Count(cpr::Session& session) {
+    CURL* handle = session.GetCurlHolder()->handle;
+    long connects = 0;
+    long version = 0;
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &version);
+    ++requests_;
+    new_connections_ += connects;
+    http2_ += version == CURL_HTTP_VERSION_2_0;
+  }
+
+  mutable std::mutex mutex_;
+  std::condition_variable_any cv_;
+  std::unordered_map<std::string, Origin, OriginHash, std::equal_to<>> origins_;
+  size_t max_per_origin_{};
+  Clock::time_point next_expiry_{};
+  std::atomic<std::uint64_t> requests_{};
+  std::atomic<std::uint64_t> new_connections_{};
+  std::atomic<std::uint64_t> http2_{};
+};
+
+// Sessions for the resolvers' API calls and for media downloads, pooled apart because downloads install their own
+// write and header callbacks.
+struct HttpPools {
+  inline static SessionPool api;
+  inline static SessionPool media;
+};
+
+}  // namespace cielparser
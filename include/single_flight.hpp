@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "quill.hpp"
+
+namespace cielparser {
+
+// Coalesces concurrent calls with the same key into one execution of the work. The work runs on its own thread and
+// receives a stop_token which is only requested once every caller waiting on it has gone away, either because its own
+// stop_token was requested or because its deadline passed.
+template <class Key, class Value>
+class SingleFlight {
+  struct Flight {
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    bool done{};
+    std::optional<Value> result;
+    size_t waiters{};
+    std::stop_source stop;
+  };
+
+ public:
+  template <class F>
+  std::optional<Value> Do(const Key& key, F&& f, const std::stop_token& caller = {},
+                          const std::chrono::steady_clock::time_point deadline =
+                              std::chrono::steady_clock::time_point::max()) {
+    std::shared_ptr<Flight> flight;
+    {
+      std::lock_guard lock(mutex_);
+      auto& slot = flights_[key];
+      if (!slot) {
+        slot = std::make_shared<Flight>();
+        std::thread([this, key, flight = slot, f = std::forward<F>(f)]() mutable {
+          std::optional<Value> value;
+          try {
+            value.emplace(f(flight->stop.get_token()));
+          } catch (const std::exception& e) {
+            LOG_ERROR("exception caught in single flight: {}", e.what());
+          }
+          Finish(key, flight, std::move(value));
+        }).detach();
+      } else {
+        LOG_INFO("Joined in-flight work, {} waiters", slot->waiters + 1);
+      }
+      flight = slot;
+      ++flight->waiters;
+    }
+
+    {
+      std::unique_lock lock(flight->mutex);
+      if (flight->cv.wait_until(lock, caller, deadline, [&] { return flight->done; })) {
+        return flight->result;
+      }
+    }
+
+    Leave(key, flight);
+    return std::nullopt;
+  }
+
+ private:
+  void Finish(const Key& key, const std::shared_ptr<Flight>& flight, std::optional<Value> value) {
+    {
+      std::lock_guard lock(mutex_);
+      if (const auto it = flights_.find(key); it != flights_.end() && it->second == flight) {
+        flights_.erase(it);
+      }
+    }
+    {
+      std::lock_guard lock(flight->mutex);
+      flight->result = std::move(value);
+      flight->done = true;
+    }
+    flight->cv.notify_all();
+  }
+
+  void Leave(const Key& key, const std::shared_ptr<Flight>& flight) {
+    std::lock_guard lock(mutex_);
+    if (--flight->waiters != 0) {
+      return;
+    }
+    if (const auto it = flights_.find(key); it != flights_.end() && it->second == flight) {
+      flights_.erase(it);
+    }
+    flight->stop.request_stop();
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<Key, std::shared_ptr<Flight>> flights_;
+};
+
+}  // namespace cielparser
@@ -9,6 +9,7 @@
 #include <string_view>
 #include <vector>
 
+#include "matchers.hpp"
 #include "quill.hpp"
 #include "utils.hpp"
 
@@ -16,62 +17,63 @@ namespace cielparser {
 
 class Twitter {
   inline static const std::regex url_pattern{R"((?:https?://)?(?:www\.)?(?:twitter|x)\.com/[^/]+/status/\d+)"};
+  static constexpr HttpProfile<0> http_profile{.default_ext = ".mp4"};
 
  public:
   static constexpr std::string_view NAME = "Twitter";
+  static constexpr size_t JOB_COST = 1;
 
   static std::vector<std::string> GetUrls(const std::string_view message) {
     return GetMatchedUrlsFromPattern(message, url_pattern);
   }
 
-  static std::vector<std::string> GetDownloadLinks(const std::string_view url) {
-    std::vector<std::string> res;
+  // Links to one tweet coalesce by status ID, whether from x.com or twitter.com and whatever handle they carry.
+  static std::string PostKey(const std::string_view url) {
+    const std::string_view id = FindDigitsAfter(url, "status/");
+    return id.empty() ? CanonicalUrlKey(NAME, url) : std::format("{}:{}", NAME, id);
+  }
 
+  static void GetDownloadLinks(const std::string_view url, const LinkSink& emit) {
     try {
-      const std::string id = std::regex_replace(std::string{url}, std::regex(R"(^.*status/(\d+).*$)"), "$1");
-      const auto r = HttpGet(std::format("https://api.vxtwitter.com/Twitter/status/{}", id));
+      const std::string_view id = FindDigitsAfter(url, "status/");
+      if (id.empty()) {
+        LOG_ERROR("Status id not found, url: {} ", url);
+        return;
+      }
+
+      const auto r = HttpGet(FormatUrl("https://api.vxtwitter.com/Twitter/status/{}", id));
       if (!r || r->text.empty()) {
-        return res;
+        return;
       }
 
       if (r->text[0] == '<') {
         LOG_ERROR("vxtwitter API returned HTML instead of JSON for ID {}. The service might be down or blocking.", id);
-        return res;
+        return;
       }
 
       if (const auto json = nlohmann::json::parse(r->text); json.contains("media_extended")) {
         for (const auto& media : json["media_extended"]) {
-          res.emplace_back(media["url"].get<std::string>());
+          emit(media["url"].get<std::string>());
         }
       }
     } catch (const std::exception& e) {
       LOG_ERROR("Failed to get download links for {}: {}", url, e.what());
     }
-
-    return res;
   }
 
   static std::optional<std::filesystem::path> DownloadFile(const std::string_view download_link,
                                                            const std::filesystem::path& download_dir) {
-    const auto url_prefix = download_link.substr(0, download_link.find('?'));
-    auto ext = std::filesystem::path(url_prefix).extension().string();
-    if (ext.empty()) {
-      ext = ".mp4";
-    }
-
-    std::string final_download_link{download_link};
+    std::string_view final_download_link = download_link;
+    std::string_view ext = http_profile.ExtensionForUrl(download_link);
     if (download_link.contains("pbs.twimg.com") && (ext == ".jpg" || ext == ".png")) {
+      const auto url_prefix = download_link.substr(0, download_link.find('?'));
       final_download_link =
-          std::format("{}?format=png&name=4096x4096", url_prefix.substr(0, url_prefix.length() - ext.length()));
+          FormatUrl("{}?format=png&name=4096x4096", url_prefix.substr(0, url_prefix.length() - ext.length()));
       ext = ".png";
       LOG_INFO("download_link changes from {} to {}", download_link, final_download_link);
     }
 
-    const auto r = HttpGet(final_download_link);
-    if (!r) {
-      return std::nullopt;
-    }
-    return SaveContents(download_dir, ext, final_download_link, r->text);
+    return HttpDownload(final_download_link, download_dir, ext);
   }
 };
 
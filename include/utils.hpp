@@ -1,20 +1,41 @@
 #pragma once
 
 #include <cpr/cpr.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #define MINIMP4_IMPLEMENTATION
 #include <minimp4.h>
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
-#include <ctime>
+#include <csignal>
+#include <cstdint>
 #include <exception>
 #include <filesystem>
+#include <format>
 #include <fstream>
+#include <functional>
 #include <optional>
+#include <regex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
+#include "budget.hpp"
+#include "deadline.hpp"
+#include "file_sink.hpp"
+#include "http_profile.hpp"
+#include "media_store.hpp"
 #include "quill.hpp"
+#include "session_pool.hpp"
 #include "tgbotxx/tgbotxx.hpp"
 
 namespace cielparser {
@@ -41,36 +62,268 @@ inline std::vector<std::string> GetMatchedUrlsFromPattern(const std::string_view
   return {Iterator{message.begin(), message.end(), pattern}, Iterator{}};
 }
 
+// Receives each download link as soon as the resolver knows it, so the download can start before the rest of the
+// post is resolved.
+using LinkSink = std::function<void(std::string)>;
+
+// Key of a post whose link carries no post ID: the URL without scheme, www./m. prefix, query, fragment and trailing
+// slashes.
+inline std::string CanonicalUrlKey(const std::string_view platform, std::string_view url) {
+  if (const size_t pos = url.find("://"); pos != std::string_view::npos) {
+    url.remove_prefix(pos + 3);
+  }
+  for (const std::string_view prefix : {"www.", "m."}) {
+    if (url.starts_with(prefix)) {
+      url.remove_prefix(prefix.size());
+    }
+  }
+  url = url.substr(0, url.find_first_of("?#"));
+  while (url.ends_with('/')) {
+    url.remove_suffix(1);
+  }
+  return std::format("{}:{}", platform, url);
+}
+
+inline void ApplyTransferLimits(cpr::Session& session) {
+  const auto& context = JobContext::Current();
+  session.SetConnectTimeout(cpr::ConnectTimeout{TransferLimits::connect_timeout});
+  session.SetLowSpeed(cpr::LowSpeed{TransferLimits::low_speed_bytes,
+                                    static_cast<std::int32_t>(TransferLimits::low_speed_time.count())});
+  session.SetTimeout(cpr::Timeout{context.Remaining()});
+  session.SetProgressCallback(cpr::ProgressCallback{
+      [&context](auto, auto, auto, auto, std::intptr_t) { return !context.Cancelled(); }});
+}
+
+// Points a pooled session at url with the given headers and parameters, replacing those of its previous request. Once
+// the session and the thread's buffers have grown to the usual request size this does not allocate.
+inline void PrepareRequest(PooledSession& session, const std::string_view url, const cpr::Header& headers,
+                           const cpr::Parameters& params = {}) {
+  session.SetUrl(ThreadUrl(url));
+  session.SetHeader(headers);
+  session.SetParameters(params);
+  ApplyTransferLimits(session);
+}
+
 inline std::optional<cpr::Response> HttpGet(const std::string_view url, const cpr::Header& headers = {},
                                             const cpr::Parameters& params = {}) {
-  cpr::Response r = cpr::Get(cpr::Url{url}, params, headers);
+  if (JobContext::Current().Cancelled()) {
+    LOG_WARNING("Skip downloading {}, the job is cancelled or past its deadline", url);
+    return std::nullopt;
+  }
+
+  auto lease = HttpPools::api.Acquire(url);
+  if (!lease) {
+    LOG_WARNING("Skip downloading {}, the job is cancelled or past its deadline", url);
+    return std::nullopt;
+  }
+  PrepareRequest(lease->session(), url, headers, params);
+  cpr::Response r = lease->Get();
   if (r.status_code != 200) {
-    LOG_ERROR("Download {} failed, status_code = {}", url, r.status_code);
+    LOG_ERROR("Download {} failed, status_code = {}, error = {}", url, r.status_code, r.error.message);
     return std::nullopt;
   }
   return r;
 }
 
-inline std::filesystem::path SaveContents(const std::filesystem::path& download_dir, const std::string_view ext,
-                                          const std::string_view download_link, const std::string_view file_contents) {
-  while (true) {
-    const auto now = std::chrono::system_clock::now();
-    const auto tt = std::chrono::system_clock::to_time_t(now);
-    const auto* lt = std::localtime(&tt);
-    const auto nanos =
-        std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count() % 1'000'000'000;
-
-    char time_buf[16];
-    std::strftime(time_buf, sizeof(time_buf), "%Y%m%d_%H%M%S", lt);
-    auto filepath = download_dir / std::format("{}_{:09d}{}", time_buf, nanos, ext);
-    std::ofstream ofs(filepath, std::ios::out | std::ios::binary | std::ios::noreplace);
-    if (!ofs) {
+// Runs args and returns its stdout. The child gets its own process group, which is killed as a whole once the job
+// is cancelled or past its deadline.
+inline std::optional<std::string> RunProcess(const std::vector<std::string>& args) {
+  int fds[2];
+  if (::pipe2(fds, O_CLOEXEC) != 0) {
+    LOG_ERROR("pipe2 failed, errno = {}", errno);
+    return std::nullopt;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+
+  std::vector<char*> argv;
+  argv.reserve(args.size() + 1);
+  for (const auto& arg : args) {
+    argv.emplace_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.emplace_back(nullptr);
+
+  pid_t pid{};
+  const int rc = ::posix_spawnp(&pid, argv.front(), &actions, &attr, argv.data(), environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  ::close(fds[1]);
+  if (rc != 0) {
+    ::close(fds[0]);
+    LOG_ERROR("Failed to run {}, error = {}", args.front(), rc);
+    return std::nullopt;
+  }
+
+  const auto& context = JobContext::Current();
+  std::string output;
+  bool cancelled = false;
+  std::array<char, 4096> buffer{};
+  while (!(cancelled = context.Cancelled())) {
+    pollfd pfd{.fd = fds[0], .events = POLLIN, .revents = 0};
+    if (const int n = ::poll(&pfd, 1, 100); n <= 0) {
+      if (n < 0 && errno != EINTR) {
+        break;
+      }
       continue;
     }
-    ofs << file_contents;
-    LOG_INFO("Downloaded {} in {}", download_link, filepath.string());
-    return filepath;
+    const ssize_t n = ::read(fds[0], buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    output.append(buffer.data(), n);
   }
+  ::close(fds[0]);
+
+  if (cancelled) {
+    LOG_WARNING("Kill {} (pid {}), the job is cancelled or past its deadline", args.front(), pid);
+    ::kill(-pid, SIGKILL);
+  }
+  while (::waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+  }
+  if (cancelled) {
+    return std::nullopt;
+  }
+  return output;
+}
+
+// Picks the extension of a downloaded file from the Content-Type of the response, e.g. HttpProfile::ExtensionForMime.
+using ExtensionPicker = std::function<std::string_view(std::string_view content_type)>;
+
+// Streams url into a new file in download_dir without holding the body in memory, then moves it into the MediaStore.
+// The Content-Length, or a fixed estimate without one, is reserved from TransferBudget::in_flight before the body is
+// written and grown if the body turns out longer, while every chunk is shaped by TransferBudget::download. The body is
+// written on the CurlMulti thread, so instead of waiting for either budget the transfer pauses until it may go on.
+inline std::optional<std::filesystem::path> HttpDownload(const std::string_view url,
+                                                        const std::filesystem::path& download_dir,
+                                                        const ExtensionPicker& pick_extension,
+                                                        const cpr::Header& headers = {}) {
+  const auto& context = JobContext::Current();
+  if (context.Cancelled()) {
+    LOG_WARNING("Skip downloading {}, the job is cancelled or past its deadline", url);
+    return std::nullopt;
+  }
+
+  auto lease = HttpPools::media.Acquire(url);
+  if (!lease) {
+    LOG_WARNING("Skip downloading {}, the job is cancelled or past its deadline", url);
+    return std::nullopt;
+  }
+
+  // Everything the callbacks touch, so that each of them captures a single pointer and fits in the inline storage of
+  // std::function instead of a heap block per download.
+  thread_local std::string content_type;
+  content_type.clear();
+  PooledSession& session = lease->session();
+  struct Transfer {
+    const JobContext& context;
+    const std::filesystem::path& download_dir;
+    const ExtensionPicker& pick_extension;
+    std::string& content_type;
+    CURL* handle;
+    std::uint64_t content_length{};
+    BudgetReservation reservation{TransferBudget::in_flight};
+    // Bytes of the body charged to TransferBudget::download, ahead of the written ones while a chunk is paused.
+    std::uint64_t charged{};
+    std::optional<FileSink> sink{};
+
+    // A paused chunk is delivered again, so it must not have been written yet, and is not charged twice.
+    static size_t Write(char* data, size_t, const size_t size, void* userdata) {
+      auto& transfer = *static_cast<Transfer*>(userdata);
+      if (transfer.context.Cancelled()) {
+        return 0;
+      }
+      auto& sink = transfer.sink;
+      const std::uint64_t end = (sink ? sink->written() : 0) + size;
+      const std::uint64_t expected =
+          transfer.content_length > 0 ? transfer.content_length : TransferBudget::kUnknownLengthReservation;
+      if (!transfer.reservation.TryReserve(std::max(expected, end))) {
+        CurlMulti::Shared().ResumeAt(transfer.handle, CurlMulti::Clock::now() + TransferBudget::kRetryInterval);
+        return CURL_WRITEFUNC_PAUSE;
+      }
+      if (end > transfer.charged) {
+        const auto ready = TransferBudget::download.Charge(end - transfer.charged);
+        transfer.charged = end;
+        if (ready > CurlMulti::Clock::now()) {
+          CurlMulti::Shared().ResumeAt(transfer.handle, ready);
+          return CURL_WRITEFUNC_PAUSE;
+        }
+      }
+      if (!sink) {
+        auto created = FileSink::Create(transfer.download_dir, transfer.pick_extension(transfer.content_type),
+                                        transfer.content_length);
+        if (!created) {
+          return 0;
+        }
+        sink.emplace(std::move(*created));
+      }
+      return sink->Write({data, size}) ? size : 0;
+    }
+  } transfer{.context = context,
+             .download_dir = download_dir,
+             .pick_extension = pick_extension,
+             .content_type = content_type,
+             .handle = session.GetCurlHolder()->handle};
+
+  PrepareRequest(session, url, headers);
+  session.SetHeaderCallback(cpr::HeaderCallback{[&transfer](const std::string_view line, std::intptr_t) {
+    if (line.starts_with("HTTP/")) {
+      // Each response of a redirect chain sends its own headers.
+      transfer.content_type.clear();
+      transfer.content_length = 0;
+      return true;
+    }
+    const size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      return true;
+    }
+    const auto name_is = [name = line.substr(0, colon)](const std::string_view lower) {
+      return std::ranges::equal(
+          name, lower, [](const char a, const char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+    };
+    auto value = line.substr(colon + 1);
+    value.remove_prefix(std::min(value.find_first_not_of(" \t"), value.size()));
+    value = value.substr(0, value.find_last_not_of(" \t\r\n") + 1);
+    if (name_is("content-type")) {
+      transfer.content_type.assign(value);
+    } else if (name_is("content-length")) {
+      std::from_chars(value.data(), value.data() + value.size(), transfer.content_length);
+    }
+    return true;
+  }});
+  // cpr's WriteCallback cannot pause a transfer, so Transfer::Write replaces the write function it installs, which
+  // only stays in place while cpr has a callback of its own set.
+  session.SetWriteCallback(cpr::WriteCallback{[](std::string_view, std::intptr_t) { return false; }});
+  curl_easy_setopt(transfer.handle, CURLOPT_WRITEFUNCTION, &Transfer::Write);
+  curl_easy_setopt(transfer.handle, CURLOPT_WRITEDATA, &transfer);
+
+  const cpr::Response r = lease->Get();
+  if (r.error || r.status_code != 200 || !transfer.sink) {
+    LOG_ERROR("Download {} failed, status_code = {}, error = {}", url, r.status_code, r.error.message);
+    return std::nullopt;
+  }
+
+  auto filepath = transfer.sink->Commit();
+  if (filepath) {
+    filepath = MediaStore::Adopt(*filepath, transfer.sink->digest());
+    LOG_INFO("Downloaded {} in {}", url, filepath->string());
+  }
+  return filepath;
+}
+
+inline std::optional<std::filesystem::path> HttpDownload(const std::string_view url,
+                                                        const std::filesystem::path& download_dir,
+                                                        const std::string_view ext, const cpr::Header& headers = {}) {
+  return HttpDownload(url, download_dir, [ext](std::string_view) { return ext; }, headers);
 }
 
 inline tgbotxx::Ptr<tgbotxx::ReplyParameters> MakeReplyParameters(const std::int32_t message_id) {
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
+#include <format>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <regex>
@@ -8,6 +10,7 @@
 #include <string_view>
 #include <vector>
 
+#include "matchers.hpp"
 #include "quill.hpp"
 #include "utils.hpp"
 
@@ -15,44 +18,50 @@ namespace cielparser {
 
 class WeiBo {
   inline static const std::regex url_pattern{R"((https?://(?:m\.)?weibo\.(?:com|cn)/(?!u/)[^\s]+))"};
+  static constexpr HttpProfile<5> http_profile{
+      .headers = {{
+          {"Cookie",
+           "SUB=_2AkMR47Mlf8NxqwFRmfocxG_lbox2wg7EieKnv0L-JRMxHRl-yT9yqhFdtRB6OmOdyoia9pKPkqoHRRmSBA_WNPaHuybH"},
+          {"User-Agent",
+           "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 "
+           "Safari/537.36"},
+          {"X-Requested-With", "XMLHttpRequest"},
+          {"Accept", "application/json, text/plain, */*"},
+          {"Client-Version", "v2.44.0"},
+      }}};
 
  public:
   static constexpr std::string_view NAME = "WeiBo";
+  static constexpr size_t JOB_COST = 2;
 
   static std::vector<std::string> GetUrls(const std::string_view message) {
     return GetMatchedUrlsFromPattern(message, url_pattern);
   }
 
-  static std::vector<std::string> GetDownloadLinks(const std::string_view url) {
-    std::vector<std::string> res;
+  // weibo.com/<uid>/<base62 id> and m.weibo.cn/detail/<mid> name the same post, so both coalesce by the mid.
+  static std::string PostKey(const std::string_view url) {
+    std::string_view id = url.substr(url.find_last_of('/') + 1);
+    id = id.substr(0, id.find_first_of("?#"));
+    const std::uint64_t mid = WeiboMid(id);
+    return mid == 0 ? CanonicalUrlKey(NAME, url) : std::format("{}:{}", NAME, mid);
+  }
 
+  static void GetDownloadLinks(const std::string_view url, const LinkSink& emit) {
     try {
-      std::string id(url.substr(url.find_last_of('/') + 1));
-      if (const size_t q_pos = id.find('?'); q_pos != std::string::npos) {
-        id.resize(q_pos);
-      }
+      std::string_view id = url.substr(url.find_last_of('/') + 1);
+      id = id.substr(0, id.find('?'));
 
-      const auto r = HttpGet(
-          "https://weibo.com/ajax/statuses/show",
-          {{"Cookie",
-            "SUB=_2AkMR47Mlf8NxqwFRmfocxG_lbox2wg7EieKnv0L-JRMxHRl-yT9yqhFdtRB6OmOdyoia9pKPkqoHRRmSBA_WNPaHuybH"},
-           {"User-Agent",
-            "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 "
-            "Safari/537.36"},
-           {"Referer", std::string{url}},
-           {"X-Requested-With", "XMLHttpRequest"},
-           {"Accept", "application/json, text/plain, */*"},
-           {"Client-Version", "v2.44.0"}},
-          {{"id", id}});
+      const auto r = HttpGet(FormatUrl("https://weibo.com/ajax/statuses/show?id={}", id),
+                             StaticHeadersWithReferer<http_profile>(url));
       if (!r) {
-        return res;
+        return;
       }
 
       const auto json = nlohmann::json::parse(r->text);
 
       if (json.contains("pic_ids") && json.contains("pic_infos")) {
         for (const auto& pid : json["pic_ids"]) {
-          res.emplace_back(json["pic_infos"][pid.get<std::string>()]["largest"]["url"].get<std::string>());
+          emit(json["pic_infos"][pid.get<std::string>()]["largest"]["url"].get<std::string>());
         }
       }
 
@@ -63,7 +72,7 @@ class WeiBo {
             return a["play_info"].value("size", 0.0) < b["play_info"].value("size", 0.0);
           });
           if (best != list.end()) {
-            res.emplace_back((*best)["play_info"]["url"].get<std::string>());
+            emit((*best)["play_info"]["url"].get<std::string>());
           }
         }
       }
@@ -72,7 +81,7 @@ class WeiBo {
         for (const auto& item : json["mix_media_info"]["items"]) {
           if (item.value("type", "") == "pic") {
             if (item.contains("data") && item["data"].contains("largest") && item["data"]["largest"].contains("url")) {
-              res.emplace_back(item["data"]["largest"]["url"].get<std::string>());
+              emit(item["data"]["largest"]["url"].get<std::string>());
             }
           } else if (item.value("type", "") == "video") {
             if (item.contains("data") && item["data"].contains("media_info") &&
@@ -82,7 +91,7 @@ class WeiBo {
                 return a["play_info"].value("size", 0.0) < b["play_info"].value("size", 0.0);
               });
               if (best != list.end()) {
-                res.emplace_back((*best)["play_info"]["url"].get<std::string>());
+                emit((*best)["play_info"]["url"].get<std::string>());
               }
             }
           }
@@ -91,23 +100,11 @@ class WeiBo {
     } catch (const std::exception& e) {
       LOG_ERROR("Failed to get download links for {}: {}", url, e.what());
     }
-
-    return res;
   }
 
   static std::optional<std::filesystem::path> DownloadFile(const std::string_view download_link,
                                                            const std::filesystem::path& download_dir) {
-    const auto r = HttpGet(download_link);
-    if (!r) {
-      return std::nullopt;
-    }
-
-    const auto url_str = download_link.substr(0, download_link.find('?'));
-    auto ext = std::filesystem::path(url_str).extension().string();
-    if (ext.empty()) {
-      ext = ".bin";
-    }
-    return SaveContents(download_dir, ext, download_link, r->text);
+    return HttpDownload(download_link, download_dir, http_profile.ExtensionForUrl(download_link));
   }
 };
 
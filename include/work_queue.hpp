@@ -0,0 +1,366 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "quill.hpp"
+
+namespace cielparser {
+
+// Work queue shared by one ingest process and any number of worker processes over a Unix socket. Messages are
+// newline-delimited JSON: workers send {"op":"lease"} and get {"lease":id,"job":...} back once a job is available, then
+// {"op":"ack","lease":id} when it is done. Leases held by a disconnected worker, or held longer than the lease timeout,
+// are handed out again, so every job is delivered at least once.
+
+class LineSocket {
+ public:
+  explicit LineSocket(const int fd) : fd_(fd) {}
+
+  LineSocket(const LineSocket&) = delete;
+  LineSocket& operator=(const LineSocket&) = delete;
+
+  ~LineSocket() { ::close(fd_); }
+
+  static sockaddr_un Address(const std::filesystem::path& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.native().size() >= sizeof(addr.sun_path)) {
+      throw std::runtime_error(std::format("Socket path {} is too long", path.string()));
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+  }
+
+  static std::unique_ptr<LineSocket> Connect(const std::filesystem::path& path) {
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    auto socket = std::make_unique<LineSocket>(fd);
+    const auto addr = Address(path);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+      throw std::runtime_error(std::format("Failed to connect to {}, errno = {}", path.string(), errno));
+    }
+    return socket;
+  }
+
+  bool Send(const nlohmann::json& message) const {
+    const std::string line = message.dump() + '\n';
+    for (size_t sent = 0; sent < line.size();) {
+      const ssize_t n = ::send(fd_, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+
+  std::optional<nlohmann::json> Receive() {
+    while (true) {
+      if (const size_t pos = buffer_.find('\n'); pos != std::string::npos) {
+        const auto message = nlohmann::json::parse(std::string_view{buffer_}.substr(0, pos), nullptr, false);
+        buffer_.erase(0, pos + 1);
+        if (message.is_discarded()) {
+          return std::nullopt;
+        }
+        return message;
+      }
+
+      char chunk[4096];
+      const ssize_t n = ::recv(fd_, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        return std::nullopt;
+      }
+      buffer_.append(chunk, n);
+    }
+  }
+
+  int fd() const { return fd_; }
+
+ private:
+  int fd_;
+  std::string buffer_;
+};
+
+class WorkQueueServer {
+ public:
+  // A job not acknowledged within give_up_after of its first lease is dropped, however often it was requeued.
+  WorkQueueServer(std::filesystem::path socket_path, const std::chrono::seconds lease_timeout,
+                  const std::chrono::seconds give_up_after)
+      : socket_path_(std::move(socket_path)), lease_timeout_(lease_timeout), give_up_after_(give_up_after) {
+    std::filesystem::remove(socket_path_);
+    listener_ = std::make_unique<LineSocket>(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    const auto addr = LineSocket::Address(socket_path_);
+    if (listener_->fd() < 0 || ::bind(listener_->fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listener_->fd(), SOMAXCONN) != 0) {
+      throw std::runtime_error(std::format("Failed to listen on {}, errno = {}", socket_path_.string(), errno));
+    }
+    LOG_INFO("Work queue listening on {}", socket_path_.string());
+
+    accepter_ = std::jthread([this] { Accept(); });
+    reaper_ = std::jthread([this](const std::stop_token& stop) { Reap(stop); });
+  }
+
+  WorkQueueServer(const WorkQueueServer&) = delete;
+  WorkQueueServer& operator=(const WorkQueueServer&) = delete;
+
+  // Disconnects every worker. Jobs that are still queued or leased are dropped without calling their callbacks.
+  ~WorkQueueServer() {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+      ::shutdown(listener_->fd(), SHUT_RDWR);
+      for (const auto* connection : connections_) {
+        ::shutdown(connection->fd(), SHUT_RDWR);
+      }
+    }
+    cv_.notify_all();
+    accepter_.join();
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&] { return serving_ == 0; });
+  }
+
+  // Queues the job and returns at once. on_done runs exactly once, when a worker acknowledges the job or when the
+  // queue gives up on it.
+  void Submit(nlohmann::json job, std::function<void()> on_done) {
+    {
+      std::lock_guard lock(mutex_);
+      ready_.push_back(std::make_shared<Entry>(std::move(job), std::move(on_done)));
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  struct Entry {
+    Entry(nlohmann::json j, std::function<void()> d) : job(std::move(j)), on_done(std::move(d)) {}
+
+    nlohmann::json job;
+    std::function<void()> on_done;
+    bool done{};
+    std::chrono::steady_clock::time_point deadline{std::chrono::steady_clock::time_point::max()};
+  };
+
+  struct Lease {
+    std::shared_ptr<Entry> entry;
+    const LineSocket* owner{};
+    std::chrono::steady_clock::time_point expiry;
+  };
+
+  void Accept() {
+    while (true) {
+      const int fd = ::accept4(listener_->fd(), nullptr, nullptr, SOCK_CLOEXEC);
+      std::lock_guard lock(mutex_);
+      if (stopping_) {
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        return;
+      }
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        LOG_ERROR("Work queue stopped accepting, errno = {}", errno);
+        return;
+      }
+      auto connection = std::make_shared<LineSocket>(fd);
+      connections_.insert(connection.get());
+      ++serving_;
+      std::thread(&WorkQueueServer::Serve, this, std::move(connection)).detach();
+    }
+  }
+
+  void Serve(const std::shared_ptr<LineSocket> connection) {
+    while (const auto message = connection->Receive()) {
+      const auto op = message->value("op", "");
+      if (op == "lease") {
+        std::unique_lock lock(mutex_);
+        std::shared_ptr<Entry> entry;
+        while (!entry && !stopping_) {
+          cv_.wait(lock, [&] { return stopping_ || !ready_.empty(); });
+          if (stopping_) {
+            break;
+          }
+          entry = std::move(ready_.front());
+          ready_.pop_front();
+          // Acknowledged through an expired lease after it was requeued, or given up on.
+          if (entry->done) {
+            entry.reset();
+          }
+        }
+        if (!entry) {
+          break;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (entry->deadline == std::chrono::steady_clock::time_point::max()) {
+          entry->deadline = now + give_up_after_;
+        }
+        const std::uint64_t lease_id = next_lease_++;
+        const nlohmann::json reply{{"lease", lease_id}, {"job", entry->job}};
+        leased_.emplace(lease_id, Lease{std::move(entry), connection.get(), now + lease_timeout_});
+        lock.unlock();
+        if (!connection->Send(reply)) {
+          break;
+        }
+      } else if (op == "ack") {
+        std::unique_lock lock(mutex_);
+        const auto on_done = Ack(message->value("lease", std::uint64_t{}));
+        lock.unlock();
+        if (on_done) {
+          on_done();
+        }
+      } else {
+        LOG_WARNING("Unknown work queue message {}", message->dump());
+      }
+    }
+
+    std::lock_guard lock(mutex_);
+    std::erase_if(leased_, [&](auto& item) {
+      if (item.second.owner != connection.get()) {
+        return false;
+      }
+      LOG_WARNING("Worker disconnected, requeue lease {}", item.first);
+      ready_.push_front(std::move(item.second.entry));
+      return true;
+    });
+    connections_.erase(connection.get());
+    --serving_;
+    cv_.notify_all();
+  }
+
+  // Called with mutex_ held. A job is done once any of its leases is acknowledged, including one that expired while
+  // the worker was still running it, so a requeued copy is not run again. Returns the callback to run once mutex_ is
+  // released.
+  std::function<void()> Ack(const std::uint64_t lease_id) {
+    std::shared_ptr<Entry> entry;
+    if (const auto it = leased_.find(lease_id); it != leased_.end()) {
+      entry = it->second.entry;
+    } else if (const auto expired = expired_.find(lease_id); expired != expired_.end()) {
+      entry = expired->second;
+    } else {
+      return {};
+    }
+    return Finish(entry);
+  }
+
+  // Called with mutex_ held.
+  std::function<void()> Finish(const std::shared_ptr<Entry>& entry) {
+    entry->done = true;
+    std::erase_if(leased_, [&](const auto& item) { return item.second.entry == entry; });
+    std::erase_if(expired_, [&](const auto& item) { return item.second == entry; });
+    return std::exchange(entry->on_done, {});
+  }
+
+  void Reap(const std::stop_token& stop) {
+    std::unique_lock lock(mutex_);
+    while (!reaper_cv_.wait_for(lock, stop, std::chrono::seconds(1), [] { return false; }) &&
+           !stop.stop_requested()) {
+      const auto now = std::chrono::steady_clock::now();
+      std::vector<std::function<void()>> given_up;
+      const auto give_up = [&](const std::shared_ptr<Entry>& entry) {
+        if (entry->done || entry->deadline > now) {
+          return false;
+        }
+        LOG_ERROR("Giving up on job {}, not acknowledged within {}s", entry->job.dump(), give_up_after_.count());
+        given_up.push_back(Finish(entry));
+        return true;
+      };
+      std::erase_if(ready_, give_up);
+      // Finish erases every lease of the job, so collect them first.
+      std::vector<std::shared_ptr<Entry>> leased_entries;
+      for (const auto& [lease_id, lease] : leased_) {
+        leased_entries.push_back(lease.entry);
+      }
+      std::ranges::for_each(leased_entries, give_up);
+
+      std::erase_if(leased_, [&](auto& item) {
+        if (item.second.expiry > now) {
+          return false;
+        }
+        LOG_WARNING("Lease {} expired, requeue", item.first);
+        expired_.emplace(item.first, item.second.entry);
+        ready_.push_front(std::move(item.second.entry));
+        return true;
+      });
+      cv_.notify_all();
+
+      lock.unlock();
+      for (const auto& on_done : given_up) {
+        if (on_done) {
+          on_done();
+        }
+      }
+      lock.lock();
+    }
+  }
+
+  std::filesystem::path socket_path_;
+  std::chrono::seconds lease_timeout_;
+  std::chrono::seconds give_up_after_;
+  std::unique_ptr<LineSocket> listener_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable_any reaper_cv_;
+  std::deque<std::shared_ptr<Entry>> ready_;
+  std::map<std::uint64_t, Lease> leased_;
+  // Leases that expired, kept so that a late acknowledgement still completes their job.
+  std::map<std::uint64_t, std::shared_ptr<Entry>> expired_;
+  std::uint64_t next_lease_{};
+  std::set<const LineSocket*> connections_;
+  size_t serving_{};
+  bool stopping_{};
+  std::jthread accepter_;
+  std::jthread reaper_;
+};
+
+class WorkQueueClient {
+ public:
+  explicit WorkQueueClient(const std::filesystem::path& socket_path) : socket_(LineSocket::Connect(socket_path)) {}
+
+  // Blocks until a job is available, returns std::nullopt if the connection is lost.
+  std::optional<std::pair<std::uint64_t, nlohmann::json>> Lease() {
+    if (!socket_->Send({{"op", "lease"}})) {
+      return std::nullopt;
+    }
+    auto reply = socket_->Receive();
+    if (!reply) {
+      return std::nullopt;
+    }
+    return std::pair{(*reply)["lease"].get<std::uint64_t>(), std::move((*reply)["job"])};
+  }
+
+  bool Ack(const std::uint64_t lease_id) { return socket_->Send({{"op", "ack"}, {"lease", lease_id}}); }
+
+ private:
+  std::unique_ptr<LineSocket> socket_;
+};
+
+}  // namespace cielparser
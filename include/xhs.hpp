@@ -2,7 +2,6 @@
 
 #include <filesystem>
 #include <format>
-#include <map>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <regex>
@@ -10,41 +9,51 @@
 #include <string_view>
 #include <vector>
 
+#include "matchers.hpp"
 #include "quill.hpp"
 #include "utils.hpp"
 
 namespace cielparser {
 
 class XHS {
+  static constexpr std::string_view image_host = "https://ci.xiaohongshu.com/";
   inline static const std::regex url_pattern{R"(https?://(?:www\.)?(?:xiaohongshu|xhslink)\.com/[\w\-./?=&%]+)"};
+  static constexpr HttpProfile<2> page_profile{
+      .headers = {{{"User-Agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) Chrome/121.0.0.0 Safari/537.36"},
+                   {"Referer", "https://www.xiaohongshu.com/"}}}};
+  static constexpr HttpProfile<0, 5> http_profile{.mime_types = {{{"image/jpeg", ".jpeg"},
+                                                                  {"image/png", ".png"},
+                                                                  {"image/webp", ".webp"},
+                                                                  {"video/mp4", ".mp4"},
+                                                                  {"binary/octet-stream", ".mp4"}}}};
 
  public:
   static constexpr std::string_view NAME = "XHS";
+  static constexpr size_t JOB_COST = 2;
 
   static std::vector<std::string> GetUrls(const std::string_view message) {
     return GetMatchedUrlsFromPattern(message, url_pattern);
   }
 
-  static std::vector<std::string> GetDownloadLinks(const std::string_view url) {
-    std::vector<std::string> res;
+  // xhslink.com short links carry no note ID until they are resolved.
+  static std::string PostKey(const std::string_view url) { return CanonicalUrlKey(NAME, url); }
 
+  static void GetDownloadLinks(const std::string_view url, const LinkSink& emit) {
     try {
-      const auto r =
-          HttpGet(url, {{"User-Agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) Chrome/121.0.0.0 Safari/537.36"},
-                        {"Referer", "https://www.xiaohongshu.com/"}});
+      const auto r = HttpGet(url, StaticHeaders<page_profile>());
       if (!r) {
-        return res;
+        return;
       }
 
       const size_t start = r->text.find("window.__INITIAL_STATE__=");
       if (start == std::string::npos) {
         LOG_ERROR("Could not find window.__INITIAL_STATE__= in url {}", url);
-        return res;
+        return;
       }
 
       const size_t json_start = r->text.find('{', start);
       if (json_start == std::string::npos) {
-        return res;
+        return;
       }
 
       size_t json_end = json_start;
@@ -61,16 +70,17 @@ class XHS {
 
       if (json_end == r->text.size()) {
         LOG_ERROR("Unbalanced braces in JSON state");
-        return res;
+        return;
       }
 
-      const std::string raw_json = SanitizeJson(r->text.substr(json_start, json_end - json_start + 1));
+      const std::string raw_json =
+          SanitizeJson(std::string_view{r->text}.substr(json_start, json_end - json_start + 1));
       const auto data = nlohmann::json::parse(raw_json);
 
       const std::string nid = data["note"]["firstNoteId"];
       if (nid.empty()) {
         LOG_ERROR("Note ID is empty, note may not exist or requires login");
-        return res;
+        return;
       }
 
       const auto& note_data = data["note"]["noteDetailMap"][nid]["note"];
@@ -86,19 +96,19 @@ class XHS {
 
       if (note_data.value("type", "") == "video" && note_data.contains("video")) {
         if (std::string video_url = extract_video(note_data["video"]["media"]["stream"]); !video_url.empty()) {
-          res.emplace_back(std::move(video_url));
-          return res;
+          emit(std::move(video_url));
+          return;
         }
       }
 
       if (!note_data.contains("imageList") || !note_data["imageList"].is_array()) {
-        return res;
+        return;
       }
 
       for (const auto& item : note_data["imageList"]) {
         if (item.contains("stream")) {
           if (std::string live_video_url = extract_video(item["stream"]); !live_video_url.empty()) {
-            res.emplace_back(std::move(live_video_url));
+            emit(std::move(live_video_url));
           }
         }
 
@@ -108,59 +118,30 @@ class XHS {
           continue;
         }
 
-        if (const std::string key = ExtractImageKey(raw_url); !key.empty()) {
-          res.emplace_back(std::format("https://ci.xiaohongshu.com/{}", key));
+        if (const std::string_view key = FindXhsImageKey(raw_url); !key.empty()) {
+          emit(std::format("{}{}", image_host, key));
         }
       }
     } catch (const std::exception& e) {
       LOG_ERROR("Failed to get download links for {}: {}", url, e.what());
     }
-
-    return res;
   }
 
   static std::optional<std::filesystem::path> DownloadFile(const std::string_view download_link,
                                                            const std::filesystem::path& download_dir) {
-    auto r = HttpGet(download_link);
-    if (!r) {
-      return std::nullopt;
-    }
-
-    if (r->header["Content-Type"].contains("image/")) {
-      if (auto r_png = HttpGet(std::string{download_link} += "?imageView2/format/png")) {
-        r = std::move(r_png);
-      }
-    }
-
-    std::string ext = ".bin";
-    for (const auto& [type, suffix] : mime_map) {
-      if (r->header["Content-Type"].find(type) != std::string::npos) {
-        ext = suffix;
-        break;
+    const auto pick_extension = [](const std::string_view content_type) {
+      return http_profile.ExtensionForMime(content_type);
+    };
+
+    // Only the PNG variant of an image is kept, the original is the fallback if the variant cannot be fetched.
+    if (download_link.starts_with(image_host)) {
+      if (auto png = HttpDownload(FormatUrl("{}?imageView2/format/png", download_link), download_dir,
+                                  pick_extension)) {
+        return png;
       }
+      LOG_WARNING("Fall back to the original of {}", download_link);
     }
-
-    return SaveContents(download_dir, ext, download_link, r->text);
-  }
-
- private:
-  inline static const std::map<std::string, std::string> mime_map = {{"image/jpeg", ".jpeg"},
-                                                                     {"image/png", ".png"},
-                                                                     {"image/webp", ".webp"},
-                                                                     {"video/mp4", ".mp4"},
-                                                                     {"binary/octet-stream", ".mp4"}};
-
-  static std::string ExtractImageKey(const std::string& url) {
-    static const std::regex pattern(R"(\/[0-9a-f]{32}\/(.+?)!)");
-    if (std::smatch match; std::regex_search(url, match, pattern) && match.size() > 1) {
-      return match[1].str();
-    }
-    return "";
-  }
-
-  static std::string SanitizeJson(const std::string& raw) {
-    static const std::regex undefined_pattern(R"(:undefined)");
-    return std::regex_replace(raw, undefined_pattern, ":null");
+    return HttpDownload(download_link, download_dir, pick_extension);
   }
 };
 
@@ -1,3 +1,488 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <latch>
+#include <mutex>
+#include <new>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bilibili.hpp"
+#include "budget.hpp"
+#include "curl_multi.hpp"
+#include "deadline.hpp"
+#include "file_sink.hpp"
+#include "http_profile.hpp"
+#include "journal.hpp"
+#include "pixiv.hpp"
 #include "quill.hpp"
+#include "scheduler.hpp"
+#include "session_pool.hpp"
+#include "single_flight.hpp"
+#include "twitter.hpp"
+#include "utils.hpp"
+#include "weibo.hpp"
+#include "work_queue.hpp"
+
+namespace {
+
+thread_local bool g_count_allocations = false;
+thread_local size_t g_allocations = 0;
+
+}  // namespace
+
+void* operator new(const size_t size) {
+  if (g_count_allocations) {
+    ++g_allocations;
+  }
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+int g_failures = 0;
+
+#define EXPECT(condition)                                                                 \
+  do {                                                                                    \
+    if (!(condition)) {                                                                   \
+      std::fprintf(stderr, "%s:%d: EXPECT(%s) failed\n", __FILE__, __LINE__, #condition); \
+      ++g_failures;                                                                       \
+    }                                                                                     \
+  } while (false)
+
+using cielparser::ExtensionOf;
+using cielparser::HttpProfile;
+using cielparser::JobContext;
+
+static_assert(ExtensionOf("https://i.pximg.net/img-original/img/2024/01/01/00/00/00/123_p0.png") == ".png");
+static_assert(ExtensionOf("https://video.twimg.com/ext_tw_video/1/pu/vid/720x1280/a.mp4?tag=12") == ".mp4");
+static_assert(ExtensionOf("https://ci.xiaohongshu.com/1040g2sg30u").empty());
+static_assert(ExtensionOf("https://upos-sz.bilivideo.com/a/b/1-1-100.m4s?e=ig8.e") == ".m4s");
+static_assert(ExtensionOf("https://weibo.cn/a.b/c?x=1.2").empty());
+
+constexpr HttpProfile<2, 2> kExampleProfile{
+    .headers = {{{"User-Agent", "Mozilla/5.0"}, {"Referer", "https://www.pixiv.net/"}}},
+    .mime_types = {{{"video", ".mp4"}, {"image", ".jpeg"}}},
+};
+static_assert(kExampleProfile.ExtensionForMime("image/webp") == ".jpeg");
+static_assert(kExampleProfile.ExtensionForMime("text/html") == ".bin");
+static_assert(HttpProfile<0>{.default_ext = ".mp4"}.ExtensionForUrl("https://video.twimg.com/a/b") == ".mp4");
+
+JobContext WithTimeout(const std::chrono::milliseconds timeout) { return {{}, JobContext::Clock::now() + timeout}; }
+
+// Two downloads without Content-Length grow their reservations into a full budget. Neither may wait for the other.
+void TestBudgetGrowthDoesNotDeadlock() {
+  cielparser::ByteBudget budget;
+  budget.SetCapacity(100);
+  cielparser::BudgetReservation a(budget);
+  cielparser::BudgetReservation b(budget);
+  EXPECT(a.Reserve(60, WithTimeout(std::chrono::seconds(2))));
+  EXPECT(b.Reserve(40, WithTimeout(std::chrono::seconds(2))));
+
+  const auto start = JobContext::Clock::now();
+  auto grow_a = std::async(std::launch::async, [&] { return a.Reserve(80, WithTimeout(std::chrono::seconds(2))); });
+  auto grow_b = std::async(std::launch::async, [&] { return b.Reserve(70, WithTimeout(std::chrono::seconds(2))); });
+  EXPECT(grow_a.get());
+  EXPECT(grow_b.get());
+  EXPECT(JobContext::Clock::now() - start < std::chrono::milliseconds(500));
+  EXPECT(budget.GetUsage().in_use == 150);
+
+  // A new transfer still waits while the budget is overdrawn.
+  cielparser::BudgetReservation c(budget);
+  EXPECT(!c.Reserve(10, WithTimeout(std::chrono::milliseconds(100))));
+}
+
+// Once a pooled session has been prepared for a request, preparing it for the next URL with the same headers allocates
+// nothing, in this library or in the cpr setters. What Get() and libcurl allocate is not covered.
+void TestPrepareRequestDoesNotAllocate() {
+  cielparser::SessionPool pool;
+  auto lease = pool.Acquire("https://www.pixiv.net/ajax/illust");
+  EXPECT(lease.has_value());
+  if (!lease) {
+    return;
+  }
+  const auto prepare = [&session = lease->session()](const int id) {
+    cielparser::PrepareRequest(session, cielparser::FormatUrl("https://www.pixiv.net/ajax/illust/{}/pages", id),
+                               cielparser::StaticHeaders<kExampleProfile>());
+  };
+  prepare(100000000);
+
+  g_allocations = 0;
+  g_count_allocations = true;
+  for (int id = 100000001; id <= 100001000; ++id) {
+    prepare(id);
+  }
+  g_count_allocations = false;
+  EXPECT(g_allocations == 0);
+}
+
+// The same post linked through different hosts, handles or ID spellings shares one key.
+void TestPostKeys() {
+  using cielparser::Bilibili, cielparser::Pixiv, cielparser::Twitter, cielparser::WeiBo;
+  EXPECT(Twitter::PostKey("https://x.com/a/status/123?s=20") == Twitter::PostKey("https://twitter.com/b/status/123"));
+  EXPECT(Twitter::PostKey("https://x.com/a/status/123") != Twitter::PostKey("https://x.com/a/status/124"));
+  EXPECT(Pixiv::PostKey("https://www.pixiv.net/artworks/42") == Pixiv::PostKey("https://pixiv.net/artworks/42?p=1"));
+  EXPECT(Bilibili::PostKey("https://www.bilibili.com/video/BV1xx411c7mD?p=2") ==
+         Bilibili::PostKey("https://m.bilibili.com/video/BV1xx411c7mD/"));
+  EXPECT(WeiBo::PostKey("https://weibo.com/1234567890/NAMhW4fm9") ==
+         WeiBo::PostKey("https://m.weibo.cn/detail/4987654321012345"));
+}
+
+// Blocks until stop is requested.
+void WaitForStop(const std::stop_token& stop) {
+  std::mutex mutex;
+  std::condition_variable_any cv;
+  std::unique_lock lock(mutex);
+  cv.wait(lock, stop, [] { return false; });
+}
+
+void TestSingleFlight() {
+  cielparser::SingleFlight<std::string, int> flights;
+
+  // Concurrent callers with one key share one run.
+  std::atomic<int> runs{0};
+  std::promise<void> release;
+  const auto released = release.get_future().share();
+  const auto work = [&runs, released](std::stop_token) {
+    ++runs;
+    released.wait();
+    return 42;
+  };
+  auto first = std::async(std::launch::async, [&] { return flights.Do("post", work); });
+  auto second = std::async(std::launch::async, [&] { return flights.Do("post", work); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  release.set_value();
+  EXPECT(first.get() == 42);
+  EXPECT(second.get() == 42);
+  EXPECT(runs == 1);
+
+  // A caller leaving at its deadline does not cancel the work while another still waits; the last one leaving does.
+  std::atomic<bool> finished{false};
+  const auto cancellable = [&finished](std::stop_token stop) {
+    WaitForStop(stop);
+    finished = true;
+    return 0;
+  };
+  std::stop_source stay;
+  auto early = std::async(std::launch::async, [&] {
+    return flights.Do("slow", cancellable, {}, JobContext::Clock::now() + std::chrono::milliseconds(100));
+  });
+  auto late = std::async(std::launch::async, [&] { return flights.Do("slow", cancellable, stay.get_token()); });
+  EXPECT(!early.get().has_value());
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT(!finished);
+  stay.request_stop();
+  EXPECT(!late.get().has_value());
+  for (int i = 0; i < 100 && !finished; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT(finished);
+}
+
+void TestSchedulerPerChatCap() {
+  cielparser::FairScheduler scheduler({.workers = 4, .per_chat_concurrency = 2});
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  std::latch done(6);
+  std::promise<void> release;
+  const auto released = release.get_future().share();
+  for (int i = 0; i < 6; ++i) {
+    scheduler.Submit(1, i, 1, [&, released] {
+      const int now = ++running;
+      for (int seen = max_running; seen < now && !max_running.compare_exchange_weak(seen, now);) {
+      }
+      released.wait();
+      --running;
+      done.count_down();
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT(scheduler.GetStats().running == 2);
+  release.set_value();
+  done.wait();
+  EXPECT(max_running == 2);
+}
+
+// A deferred job holds its chat's slot until released, but not its worker thread.
+void TestSchedulerDeferredRelease() {
+  cielparser::FairScheduler scheduler({.workers = 1, .per_chat_concurrency = 1});
+  std::promise<cielparser::FairScheduler::Release> handed_off;
+  scheduler.SubmitDeferred(1, 1, 1, [&](cielparser::FairScheduler::Release release) {
+    handed_off.set_value(std::move(release));
+  });
+  const auto release = handed_off.get_future().get();
+
+  std::promise<void> same_chat;
+  std::promise<void> other_chat;
+  scheduler.Submit(1, 1, 1, [&] { same_chat.set_value(); });
+  scheduler.Submit(2, 2, 1, [&] { other_chat.set_value(); });
+  EXPECT(other_chat.get_future().wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+  auto same_chat_done = same_chat.get_future();
+  EXPECT(same_chat_done.wait_for(std::chrono::milliseconds(100)) == std::future_status::timeout);
+  release();
+  release();
+  EXPECT(same_chat_done.wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+}
+
+// A chat flooding the queue with cheap jobs only delays another chat's expensive job by a few turns.
+void TestSchedulerDoesNotStarveLargeJobs() {
+  cielparser::FairScheduler scheduler({.workers = 1});
+  std::promise<void> release;
+  scheduler.Submit(0, 0, 1, [released = release.get_future().share()] { released.wait(); });
+
+  std::mutex mutex;
+  std::vector<std::int64_t> order;
+  std::latch done(11);
+  const auto record = [&](const std::int64_t chat_id) {
+    return [&, chat_id] {
+      {
+        std::lock_guard lock(mutex);
+        order.push_back(chat_id);
+      }
+      done.count_down();
+    };
+  };
+  for (int i = 0; i < 10; ++i) {
+    scheduler.Submit(1, 1, 1, record(1));
+  }
+  scheduler.Submit(2, 2, 8, record(2));
+  release.set_value();
+  done.wait();
+  EXPECT(std::ranges::find(order, 2) - order.begin() <= 3);
+}
+
+// A fresh path under the temporary directory.
+std::filesystem::path TempPath(const std::string_view name) {
+  auto path = std::filesystem::temp_directory_path() / std::format("ciel_parser_test_{}_{}", ::getpid(), name);
+  std::filesystem::remove(path);
+  return path;
+}
+
+size_t CountLines(const std::filesystem::path& path) {
+  std::ifstream ifs(path);
+  size_t lines = 0;
+  for (std::string line; std::getline(ifs, line);) {
+    ++lines;
+  }
+  return lines;
+}
+
+// A record torn by a crash is cut off on replay, so the first record appended after the restart survives the next one.
+void TestJournalDropsTornRecord() {
+  const auto path = TempPath("journal_torn.jsonl");
+  {
+    cielparser::Journal journal(path);
+    journal.Received(1, 10, "Twitter", "https://x.com/a/status/1");
+  }
+  std::ofstream(path, std::ios::app) << R"({"type":"uploaded","i)";
+  {
+    cielparser::Journal journal(path);
+    EXPECT(journal.Unfinished().size() == 1);
+    journal.Received(2, 20, "Pixiv", "https://www.pixiv.net/artworks/2");
+  }
+  cielparser::Journal journal(path);
+  EXPECT(journal.Unfinished().size() == 2);
+  std::filesystem::remove(path);
+}
+
+void TestJournalCompaction() {
+  const auto path = TempPath("journal_compact.jsonl");
+  std::uint64_t kept{};
+  {
+    cielparser::Journal journal(path);
+    kept = journal.Received(1, 10, "Twitter", "https://x.com/a/status/1");
+    for (size_t i = 0; i < cielparser::Journal::kCompactThreshold; ++i) {
+      journal.Uploaded(journal.Received(2, 20, "Pixiv", "https://www.pixiv.net/artworks/2"));
+    }
+  }
+  EXPECT(CountLines(path) < cielparser::Journal::kCompactThreshold);
+  cielparser::Journal journal(path);
+  const auto jobs = journal.Unfinished();
+  EXPECT(jobs.size() == 1 && jobs.front().id == kept);
+  std::filesystem::remove(path);
+}
+
+// Transfers from several threads run on the shared multi handle, and a write callback that pauses gets its data again
+// once the driver resumes it.
+void TestCurlMultiResumesPausedTransfer() {
+  const std::string contents(100000, 'x');
+  const int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in addr{.sin_family = AF_INET, .sin_port = 0, .sin_addr = {htonl(INADDR_LOOPBACK)}, .sin_zero = {}};
+  socklen_t addr_len = sizeof(addr);
+  EXPECT(::bind(listener, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0 && ::listen(listener, 4) == 0 &&
+         ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len) == 0);
+  // Answers one GET per connection.
+  std::jthread server([&] {
+    for (int i = 0; i < 2; ++i) {
+      const int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      std::string request;
+      char chunk[1024];
+      while (!request.contains("\r\n\r\n")) {
+        const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+          break;
+        }
+        request.append(chunk, n);
+      }
+      const std::string response =
+          std::format("HTTP/1.1 200 OK\r\nContent-Length: {}\r\n\r\n{}", contents.size(), contents);
+      for (size_t sent = 0; sent < response.size();) {
+        const ssize_t n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+          break;
+        }
+        sent += n;
+      }
+      ::close(fd);
+    }
+  });
+  const std::string url = std::format("http://127.0.0.1:{}/", ntohs(addr.sin_port));
+
+  struct Received {
+    CURL* handle;
+    std::string data;
+    int pauses{};
+  };
+  const auto write = +[](char* data, size_t, const size_t size, void* userdata) -> size_t {
+    auto& received = *static_cast<Received*>(userdata);
+    if (received.pauses++ == 0) {
+      cielparser::CurlMulti::Shared().ResumeAt(received.handle,
+                                               cielparser::CurlMulti::Clock::now() + std::chrono::milliseconds(50));
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    received.data.append(data, size);
+    return size;
+  };
+  const auto fetch = [&] {
+    Received received{curl_easy_init()};
+    curl_easy_setopt(received.handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(received.handle, CURLOPT_FORBID_REUSE, 1L);
+    curl_easy_setopt(received.handle, CURLOPT_WRITEFUNCTION, write);
+    curl_easy_setopt(received.handle, CURLOPT_WRITEDATA, &received);
+    const CURLcode result = cielparser::CurlMulti::Shared().Perform(received.handle);
+    curl_easy_cleanup(received.handle);
+    return result == CURLE_OK && received.data == contents && received.pauses > 1;
+  };
+  auto first = std::async(std::launch::async, fetch);
+  auto second = std::async(std::launch::async, fetch);
+  EXPECT(first.get());
+  EXPECT(second.get());
+  ::shutdown(listener, SHUT_RDWR);
+  server.join();
+  ::close(listener);
+}
+
+// Files larger than several buffers come out intact through io_uring and through the pwrite fallback alike.
+void TestFileSinkWrites() {
+  std::string contents(cielparser::FileSink::kBufferSize * 5 + 12345, '\0');
+  for (size_t i = 0; i < contents.size(); ++i) {
+    contents[i] = static_cast<char>(i * 131 + i / 4096);
+  }
+  const auto dir = TempPath("file_sink");
+  std::filesystem::create_directories(dir);
+  for (const bool use_io_uring : {true, false}) {
+    cielparser::FileSink::use_io_uring = use_io_uring;
+    auto sink = cielparser::FileSink::Create(dir, ".bin", contents.size());
+    EXPECT(sink.has_value());
+    for (std::string_view rest = contents; !rest.empty();) {
+      const auto chunk = rest.substr(0, 16381);
+      EXPECT(sink->Write(chunk));
+      rest.remove_prefix(chunk.size());
+    }
+    const auto digest = sink->digest();
+    const auto path = sink->Commit();
+    EXPECT(path.has_value());
+    std::ifstream file(*path, std::ios::binary);
+    const std::string written{std::istreambuf_iterator<char>(file), {}};
+    EXPECT(written == contents);
+    EXPECT(XXH128_isEqual(digest, XXH3_128bits(contents.data(), contents.size())));
+  }
+  cielparser::FileSink::use_io_uring = true;
+  std::filesystem::remove_all(dir);
+}
+
+// An unacknowledged lease is handed to another worker, and a late acknowledgement through the expired lease still
+// completes the job exactly once.
+void TestWorkQueueLateAck() {
+  const auto socket_path = TempPath("queue_late_ack.sock");
+  cielparser::WorkQueueServer server(socket_path, std::chrono::seconds(1), std::chrono::seconds(60));
+  std::atomic<int> completions{0};
+  server.Submit({{"url", "first"}}, [&] { ++completions; });
+
+  cielparser::WorkQueueClient slow(socket_path);
+  cielparser::WorkQueueClient fast(socket_path);
+  const auto expired = slow.Lease();
+  EXPECT(expired && expired->second["url"] == "first");
+  const auto requeued = fast.Lease();
+  EXPECT(requeued && requeued->second["url"] == "first");
+  EXPECT(slow.Ack(expired->first));
+  for (int i = 0; i < 100 && completions == 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT(fast.Ack(requeued->first));
+
+  // Round trip on the connection that acknowledged last, so its ack has been handled.
+  server.Submit({{"url", "second"}}, [] {});
+  const auto next = fast.Lease();
+  EXPECT(next && next->second["url"] == "second");
+  EXPECT(completions == 1);
+}
+
+// A job that keeps timing out is dropped once it exceeds the give-up time, releasing whoever waits on it.
+void TestWorkQueueGivesUp() {
+  const auto socket_path = TempPath("queue_give_up.sock");
+  cielparser::WorkQueueServer server(socket_path, std::chrono::seconds(1), std::chrono::seconds(2));
+  std::promise<void> done;
+  server.Submit({{"url", "stuck"}}, [&] { done.set_value(); });
+  cielparser::WorkQueueClient worker(socket_path);
+  EXPECT(worker.Lease().has_value());
+  EXPECT(done.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+}
+
+}  // namespace
 
-int main() { LOG_INFO("Hello ciel_parser"); }
+int main() {
+  cielparser::SetupQuill(std::filesystem::temp_directory_path() / "ciel_parser_test.log");
+  TestBudgetGrowthDoesNotDeadlock();
+  TestPrepareRequestDoesNotAllocate();
+  TestPostKeys();
+  TestSingleFlight();
+  TestSchedulerPerChatCap();
+  TestSchedulerDeferredRelease();
+  TestSchedulerDoesNotStarveLargeJobs();
+  TestJournalDropsTornRecord();
+  TestJournalCompaction();
+  TestCurlMultiResumesPausedTransfer();
+  TestFileSinkWrites();
+  TestWorkQueueLateAck();
+  TestWorkQueueGivesUp();
+  if (g_failures > 0) {
+    LOG_ERROR("{} expectations failed", g_failures);
+    return 1;
+  }
+  LOG_INFO("All tests passed");
+}